@@ -0,0 +1,294 @@
+/*
+ * alloc_test.c
+ *
+ * checks that a connection's steady state doesn't touch the heap.  the
+ * process forks into a receiver and a sender, which set up a connection
+ * over loopback, warm it up with a few megabytes so the buffers and
+ * payload pools reach their working size (a full queue of the sender's
+ * writes, at worst), then count the allocations (malloc() and friends,
+ * operator new included) made by every thread in each process while the
+ * rest of the transfer goes through, up to the connection being closed.
+ * any allocation at all fails the test.
+ *
+ * the buffer sizes are fixed (TEST_BUF_LEN), as autotuning grows them,
+ * and with them the pools, for as long as the measured bandwidth-delay
+ * product keeps going up; that's a one-off cost per connection, but one
+ * with no set end that a warm-up could be sure to get past.
+ *
+ * glibc only: the counting malloc() hands off to __libc_malloc().
+ *
+ * usage: alloc_test [-m megabytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <atomic>
+
+#include "mysock.h"
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+#define MB                  (1024 * 1024)
+#define WARMUP_MB           8       /* not counted */
+#define DEFAULT_MB          32      /* counted */
+#define TEST_BUF_LEN        (1024 * 1024)   /* MYSO_SNDBUF, MYSO_RCVBUF */
+#define WRITE_LEN           4096    /* divides a megabyte, not an MSS */
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void  __libc_free(void *ptr);
+}
+
+static std::atomic<unsigned long> allocs(0);
+
+static char usage[] = "usage: alloc_test [-m megabytes]\n";
+
+static int run_receiver(int port_fd, long total_mb);
+static int run_sender(unsigned short port, long total_mb);
+static int check(const char *who, unsigned long count, long mb);
+
+
+/* the counting allocator.  only allocations are counted; a free() has
+ * to match one of them anyway.
+ */
+extern "C" void *malloc(size_t size)
+{
+    allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size)
+{
+    allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(nmemb, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    allocs.fetch_add(1, std::memory_order_relaxed);
+    if (!(*memptr = __libc_memalign(alignment, size)))
+        return ENOMEM;
+    return 0;
+}
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size)
+{
+    allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+
+/**********************************************************************/
+int
+main(int argc, char *argv[])
+{
+    long total_mb = DEFAULT_MB;
+    unsigned short port;
+    int opt, status, rc;
+    int port_fds[2];
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "m:")) != EOF)
+    {
+        switch (opt)
+        {
+        case 'm':
+            total_mb = atol(optarg);
+            break;
+        default:
+            fputs(usage, stderr);
+            return 1;
+        }
+    }
+
+    if (optind != argc || total_mb <= 0)
+    {
+        fputs(usage, stderr);
+        return 1;
+    }
+
+    /* the receiver listens on whatever port it's given, and says which */
+    if (pipe(port_fds) < 0)
+    {
+        perror("pipe");
+        return 1;
+    }
+
+    fflush(stdout);
+    if ((pid = fork()) < 0)
+    {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0)
+    {
+        close(port_fds[0]);
+        rc = run_receiver(port_fds[1], total_mb);
+        fflush(stdout);
+        _exit(rc);
+    }
+
+    close(port_fds[1]);
+    if (read(port_fds[0], &port, sizeof(port)) != sizeof(port))
+        rc = 1;     /* the receiver has said why */
+    else
+        rc = run_sender(port, total_mb);
+    close(port_fds[0]);
+
+    if (waitpid(pid, &status, 0) < 0)
+    {
+        perror("waitpid");
+        return 1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        rc = 1;
+
+    printf("alloc_test: %s\n", rc ? "FAILED" : "passed");
+    return rc;
+}
+
+
+static int run_receiver(int port_fd, long total_mb)
+{
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+    mysocket_t bindsd, sd;
+    unsigned long start = 0;
+    long got = 0, warmup = WARMUP_MB * (long) MB;
+    static char buf[WRITE_LEN];
+    ssize_t n;
+    int rc;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port        = 0;
+
+    if ((bindsd = mysocket()) < 0 ||
+        mysetsockopt(bindsd, MYSO_SNDBUF, TEST_BUF_LEN) < 0 ||
+        mysetsockopt(bindsd, MYSO_RCVBUF, TEST_BUF_LEN) < 0 ||
+        mybind(bindsd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+        mylisten(bindsd, 1) < 0 ||
+        mygetsockname(bindsd, (struct sockaddr *) &sin, &sin_len) < 0)
+    {
+        perror("receiver");
+        return 1;
+    }
+    if (write(port_fd, &sin.sin_port, sizeof(sin.sin_port)) !=
+        sizeof(sin.sin_port))
+    {
+        perror("write");
+        return 1;
+    }
+    close(port_fd);
+    if ((sd = myaccept(bindsd, NULL, NULL)) < 0)
+    {
+        perror("myaccept");
+        return 1;
+    }
+
+    while ((n = myread(sd, buf, sizeof(buf))) > 0)
+    {
+        if (got < warmup && got + n >= warmup)
+            start = allocs.load();
+        got += n;
+    }
+    if (n < 0)
+    {
+        perror("myread");
+        return 1;
+    }
+    if (got != (WARMUP_MB + total_mb) * (long) MB)
+    {
+        fprintf(stderr, "receiver: got %ld bytes, expected %ld\n",
+                got, (WARMUP_MB + total_mb) * (long) MB);
+        return 1;
+    }
+
+    rc = check("receiver", allocs.load() - start, total_mb);
+    myclose(sd);
+    myclose(bindsd);
+    return rc;
+}
+
+static int run_sender(unsigned short port, long total_mb)
+{
+    struct sockaddr_in sin;
+    mysocket_t sd;
+    unsigned long start = 0;
+    long sent = 0, warmup = WARMUP_MB * (long) MB;
+    long total = (WARMUP_MB + total_mb) * (long) MB;
+    static char buf[WRITE_LEN];
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port        = port;
+    memset(buf, 'a', sizeof(buf));
+
+    if ((sd = mysocket()) < 0 ||
+        mysetsockopt(sd, MYSO_SNDBUF, TEST_BUF_LEN) < 0 ||
+        mysetsockopt(sd, MYSO_RCVBUF, TEST_BUF_LEN) < 0 ||
+        myconnect(sd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+    {
+        perror("sender");
+        return 1;
+    }
+
+    while (sent < total)
+    {
+        size_t len = (size_t) MIN((long) sizeof(buf), total - sent);
+        ssize_t n;
+
+        if (sent <= warmup && sent + (long) len > warmup)
+            start = allocs.load();
+        if ((n = mywrite(sd, buf, len)) < 0)
+        {
+            perror("mywrite");
+            myclose(sd);
+            return 1;
+        }
+        sent += n;
+    }
+
+    /* myclose() waits for STCP to see everything through, retransmits
+     * and all
+     */
+    myclose(sd);
+    return check("sender", allocs.load() - start, total_mb);
+}
+
+/* fails if there were any allocations over the mb megabytes counted */
+static int check(const char *who, unsigned long count, long mb)
+{
+    printf("%s: %lu allocations over %ld MB\n", who, count, mb);
+    if (count > 0)
+    {
+        fprintf(stderr, "%s: the steady state allocated\n", who);
+        return 1;
+    }
+    return 0;
+}
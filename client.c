@@ -34,12 +34,14 @@
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 #endif
 
-static char usage[] = "usage: client [-q] [-f <filename>] server:port\n";
+static char usage[] =
+    "usage: client [-q] [-c reno|cubic|bbr] [-f <filename>] server:port\n";
 static char *filename;
 static int quiet_opt = 0;
+static int congestion_opt = MYCC_RENO;
 
 static int parse_address(char *address, struct sockaddr_in *sin);
-static int get_nvt_line(int sd, char *line);
+static int get_nvt_line(int sd, char *line, size_t size);
 static void loop_until_end(int sd);
 
 
@@ -57,10 +59,14 @@ main(int argc, char *argv[])
 
     filename = NULL;
     /* Parse command line options */
-    while ((opt = getopt(argc, argv, "f:q")) != EOF)
+    while ((opt = getopt(argc, argv, "c:f:q")) != EOF)
     {
         switch (opt)
         {
+        case 'c':
+            if ((congestion_opt = mycongestion_by_name(optarg)) < 0)
+                ++errflg;
+            break;
         case 'f':
             filename = optarg;
             break;
@@ -99,6 +105,12 @@ main(int argc, char *argv[])
         exit(1);
     }
 
+    if (mysetsockopt(sd, MYSO_CONGESTION, congestion_opt) < 0)
+    {
+        perror("mysetsockopt");
+        exit(1);
+    }
+
     sd = myconnect(sd, (struct sockaddr *) &sin, sizeof(struct sockaddr_in));
     if (sd < 0)
     {
@@ -168,7 +180,7 @@ loop_until_end(int sd)
             break;
         }
 
-        if (get_nvt_line(sd, line) < 0)
+        if (get_nvt_line(sd, line, sizeof(line)) < 0)
         {
             perror("get_nvt_line");
             errcnd = 1;
@@ -338,36 +350,28 @@ cleanup:
  *  -1 on failure
  */
 static int
-get_nvt_line(int sd, char *line)
+get_nvt_line(int sd, char *line, size_t size)
 {
-    char last_char;
-    char this_char;
     int len;
 
-    last_char = '\0';
-    for (;;)
-    {
-        len = myread(sd, &this_char, sizeof(this_char));
-        if (len < 0)
-            return -1;
-
-        if (len == 0)
-        {
-            /* Connection ended before line terminator (or empty string) */
-            *line = '\0';
-            return 0;
-        }
-        /** fprintf(stderr, "read character %c\n", this_char); **/
-
-        if (last_char == '\r' && this_char == '\n')
-        {
-            /* Reached the end of line. Already wrote \r into string, overwrite
-             * it with a NUL */
-            line[-1] = '\0';
-            return 0;
-        }
+    /* leave room for the NUL */
+    if ((len = myreadline(sd, line, size - 1)) < 0)
+        return -1;
 
-        *line++ = this_char;
-        last_char = this_char;
+    if (len >= 2 && line[len - 2] == '\r' && line[len - 1] == '\n')
+    {
+        /* Reached the end of line; overwrite the \r with a NUL */
+        len -= 2;
     }
+    else if (len == (int) size - 1)
+    {
+        /* no terminator in the room we have */
+        errno = EMSGSIZE;
+        return -1;
+    }
+    /* otherwise the connection ended before the line terminator (or
+     * empty string) */
+
+    line[len] = '\0';
+    return 0;
 }
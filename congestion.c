@@ -0,0 +1,386 @@
+/*
+ * congestion.c
+ *
+ * congestion control algorithms for STCP: Reno, CUBIC (RFC 8312) and a
+ * cut-down BBR.  everything here works in bytes; the transport layer
+ * only ever looks at cwnd and the pacing rate.
+ *
+ */
+
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "mysock.h"
+#include "transport.h"
+#include "congestion.h"
+
+#define CC_MAX_CWND (1u << 30)
+
+#define CUBIC_C 0.4             /* scaling constant */
+#define CUBIC_BETA 0.7          /* multiplicative decrease */
+
+#define BBR_HIGH_GAIN 2.885     /* 2/ln(2), doubles the rate every round */
+#define BBR_MIN_RTT_LIFETIME 10 /* seconds before min_rtt is re-learned */
+#define BBR_CYCLE_LEN 8
+#define BBR_DRAIN_MAX_ROUNDS 4  /* cruise after this long draining, whatever */
+
+static const double bbr_pacing_cycle[BBR_CYCLE_LEN] = {
+    1.25, 0.75, 1, 1, 1, 1, 1, 1
+};
+
+
+static double seconds_between(const struct timespec *from, const struct timespec *to){
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static uint32_t clamp_cwnd(double cwnd, uint32_t mss){
+    if(cwnd < mss){
+        return mss;
+    }
+    if(cwnd > CC_MAX_CWND){
+        return CC_MAX_CWND;
+    }
+    return (uint32_t) cwnd;
+}
+
+//RFC 5681 initial window
+static uint32_t initial_cwnd(uint32_t mss){
+    return MIN(4 * mss, MAX(2 * mss, 4380u));
+}
+
+
+/**********************************************************************/
+/* Reno (RFC 5681), with NewReno recovery handled by the transport */
+
+static void reno_init(cc_state_t *cc){
+    cc->cwnd = initial_cwnd(cc->mss);
+    cc->ssthresh = CC_MAX_CWND;
+}
+
+static void reno_on_ack(cc_state_t *cc, uint32_t acked, uint32_t in_flight,
+                        long rtt, bool in_recovery, const struct timespec *now){
+    if(in_recovery){
+        //the window stays put until recovery ends
+        return;
+    }
+    if(cc->cwnd < cc->ssthresh){
+        //slow start, at most one mss per ack
+        cc->cwnd = clamp_cwnd((double) cc->cwnd + MIN(acked, cc->mss), cc->mss);
+    } else {
+        //congestion avoidance, one mss per window's worth of acks
+        cc->bytes_acked += acked;
+        if(cc->bytes_acked >= cc->cwnd){
+            cc->bytes_acked -= cc->cwnd;
+            cc->cwnd = clamp_cwnd((double) cc->cwnd + cc->mss, cc->mss);
+        }
+    }
+}
+
+static void reno_on_loss(cc_state_t *cc, uint32_t in_flight, const struct timespec *now){
+    cc->ssthresh = MAX(in_flight / 2, 2 * cc->mss);
+    //the three dup acks each mean a segment has left the network
+    cc->cwnd = cc->ssthresh + 3 * cc->mss;
+    cc->bytes_acked = 0;
+}
+
+static void reno_on_dupack(cc_state_t *cc){
+    cc->cwnd = clamp_cwnd((double) cc->cwnd + cc->mss, cc->mss);
+}
+
+static void reno_on_recovered(cc_state_t *cc){
+    cc->cwnd = cc->ssthresh;
+}
+
+static void reno_on_rto(cc_state_t *cc, uint32_t in_flight){
+    cc->ssthresh = MAX(in_flight / 2, 2 * cc->mss);
+    cc->cwnd = cc->mss;
+    cc->bytes_acked = 0;
+}
+
+static uint64_t no_pacing(cc_state_t *cc){
+    return 0;
+}
+
+const cc_ops_t cc_reno = {
+    "reno",
+    reno_init,
+    reno_on_ack,
+    reno_on_loss,
+    reno_on_dupack,
+    reno_on_recovered,
+    reno_on_rto,
+    no_pacing
+};
+
+
+/**********************************************************************/
+/* CUBIC (RFC 8312).  the window grows along a cubic centred on the size it
+ * had at the last loss, so it gets back there quickly and then probes
+ * carefully; it never does worse than Reno would (the TCP-friendly region).
+ */
+
+static void cubic_init(cc_state_t *cc){
+    reno_init(cc);
+    memset(&cc->u.cubic, 0, sizeof(cc->u.cubic));
+}
+
+static void cubic_on_ack(cc_state_t *cc, uint32_t acked, uint32_t in_flight,
+                         long rtt, bool in_recovery, const struct timespec *now){
+    cubic_state_t *cs = &cc->u.cubic;
+    double mss = cc->mss;
+
+    if(rtt > 0){
+        cc->last_rtt = rtt;
+    }
+    if(in_recovery){
+        return;
+    }
+    if(cc->cwnd < cc->ssthresh){
+        cc->cwnd = clamp_cwnd((double) cc->cwnd + MIN(acked, cc->mss), cc->mss);
+        return;
+    }
+
+    if(!cs->epoch_valid){
+        cs->epoch_valid = true;
+        cs->epoch_start = *now;
+        if(cc->cwnd < cs->w_max){
+            cs->k = cbrt((cs->w_max - cc->cwnd) / mss / CUBIC_C);
+            cs->origin = cs->w_max;
+        } else {
+            cs->k = 0;
+            cs->origin = cc->cwnd;
+        }
+        cs->w_est = cc->cwnd;
+    }
+
+    //aim for where the curve will be one rtt from now
+    double t = seconds_between(&cs->epoch_start, now) + (cc->last_rtt > 0 ? cc->last_rtt / 1e6 : 0);
+    double target = cs->origin + CUBIC_C * (t - cs->k) * (t - cs->k) * (t - cs->k) * mss;
+
+    cs->w_est += mss * (3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA)) * acked / cc->cwnd;
+    if(target < cs->w_est){
+        target = cs->w_est;
+    }
+
+    if(target > cc->cwnd){
+        cc->cwnd = clamp_cwnd(cc->cwnd + (target - cc->cwnd) * acked / cc->cwnd, cc->mss);
+    } else {
+        //plateau around w_max, creep forward very slowly
+        cc->cwnd = clamp_cwnd(cc->cwnd + mss * acked / (100.0 * cc->cwnd), cc->mss);
+    }
+}
+
+static void cubic_reduce(cc_state_t *cc){
+    cubic_state_t *cs = &cc->u.cubic;
+
+    //fast convergence: give up some headroom to newer flows
+    if(cc->cwnd < cs->w_max){
+        cs->w_max = cc->cwnd * (1 + CUBIC_BETA) / 2;
+    } else {
+        cs->w_max = cc->cwnd;
+    }
+    cs->epoch_valid = false;
+    cc->ssthresh = MAX((uint32_t)(cc->cwnd * CUBIC_BETA), 2 * cc->mss);
+}
+
+static void cubic_on_loss(cc_state_t *cc, uint32_t in_flight, const struct timespec *now){
+    cubic_reduce(cc);
+    cc->cwnd = cc->ssthresh + 3 * cc->mss;
+}
+
+static void cubic_on_rto(cc_state_t *cc, uint32_t in_flight){
+    cubic_reduce(cc);
+    cc->cwnd = cc->mss;
+}
+
+const cc_ops_t cc_cubic = {
+    "cubic",
+    cubic_init,
+    cubic_on_ack,
+    cubic_on_loss,
+    reno_on_dupack,
+    reno_on_recovered,
+    cubic_on_rto,
+    no_pacing
+};
+
+
+/**********************************************************************/
+/* BBR-lite.  models the path as a bottleneck bandwidth (windowed max of
+ * delivery rate samples) and a minimum rtt, and sizes cwnd and the pacing
+ * rate from their product instead of reacting to loss.  compared to real
+ * BBR this has no PROBE_RTT phase (min_rtt simply expires and is re-learned
+ * from the next sample) and takes one rate sample per min_rtt interval
+ * rather than per packet.
+ */
+
+static uint64_t bbr_bdp(cc_state_t *cc){
+    bbr_state_t *bbr = &cc->u.bbr;
+
+    if(bbr->max_bw == 0 || bbr->min_rtt < 0){
+        return 0;
+    }
+    return bbr->max_bw * (uint64_t) bbr->min_rtt / 1000000;
+}
+
+static void bbr_set_cwnd(cc_state_t *cc){
+    uint64_t bdp = bbr_bdp(cc);
+
+    if(bdp == 0){
+        //no model yet, keep whatever startup has grown to
+        return;
+    }
+    cc->cwnd = clamp_cwnd(MAX(cc->u.bbr.cwnd_gain * bdp, 4.0 * cc->mss), cc->mss);
+}
+
+static void bbr_enter_probe_bw(bbr_state_t *bbr){
+    bbr->mode = BBR_PROBE_BW;
+    bbr->cycle_index = 0;
+    bbr->pacing_gain = bbr_pacing_cycle[0];
+    bbr->cwnd_gain = 2;
+}
+
+static void bbr_init(cc_state_t *cc){
+    bbr_state_t *bbr = &cc->u.bbr;
+
+    cc->cwnd = initial_cwnd(cc->mss);
+    cc->ssthresh = CC_MAX_CWND;
+    memset(bbr, 0, sizeof(*bbr));
+    bbr->mode = BBR_STARTUP;
+    bbr->min_rtt = -1;
+    bbr->pacing_gain = BBR_HIGH_GAIN;
+    bbr->cwnd_gain = BBR_HIGH_GAIN;
+}
+
+//called once per round, when a new delivery rate sample is in
+static void bbr_end_round(cc_state_t *cc, uint32_t in_flight){
+    bbr_state_t *bbr = &cc->u.bbr;
+
+    switch(bbr->mode){
+        case BBR_STARTUP:
+            //the pipe is full once three rounds fail to grow bw by 25%
+            if(bbr->max_bw >= bbr->full_bw + bbr->full_bw / 4){
+                bbr->full_bw = bbr->max_bw;
+                bbr->full_bw_rounds = 0;
+            } else if(++bbr->full_bw_rounds >= 3){
+                bbr->mode = BBR_DRAIN;
+                bbr->drain_rounds = 0;
+                bbr->pacing_gain = 1 / BBR_HIGH_GAIN;
+            }
+            break;
+        case BBR_DRAIN:
+            //drain the queue startup built, then cruise.  a pipe smaller
+            //than the cwnd floor can't be drained below it, and a model
+            //that's wrong mustn't keep us pacing slow for good
+            if(in_flight <= MAX(bbr_bdp(cc), 4 * (uint64_t) cc->mss) ||
+               ++bbr->drain_rounds >= BBR_DRAIN_MAX_ROUNDS){
+                bbr_enter_probe_bw(bbr);
+            }
+            break;
+        case BBR_PROBE_BW:
+            bbr->cycle_index = (bbr->cycle_index + 1) % BBR_CYCLE_LEN;
+            bbr->pacing_gain = bbr_pacing_cycle[bbr->cycle_index];
+            break;
+    }
+}
+
+static void bbr_on_ack(cc_state_t *cc, uint32_t acked, uint32_t in_flight,
+                       long rtt, bool in_recovery, const struct timespec *now){
+    bbr_state_t *bbr = &cc->u.bbr;
+
+    if(rtt > 0 && (bbr->min_rtt < 0 || rtt <= bbr->min_rtt ||
+                   seconds_between(&bbr->min_rtt_stamp, now) > BBR_MIN_RTT_LIFETIME)){
+        bbr->min_rtt = rtt;
+        bbr->min_rtt_stamp = *now;
+    }
+
+    if(!bbr->interval_valid){
+        bbr->interval_valid = true;
+        bbr->interval_start = *now;
+        bbr->interval_delivered = 0;
+        bbr->interval_limited = false;
+    }
+    bbr->interval_delivered += acked;
+    bbr->interval_limited |= cc->send_limited;
+    cc->send_limited = false;
+
+    //one rate sample per round trip
+    double elapsed = seconds_between(&bbr->interval_start, now);
+    double round = bbr->min_rtt > 0 ? bbr->min_rtt / 1e6 : 0.001;
+    if(elapsed >= round && elapsed > 0){
+        uint64_t sample = (uint64_t)(bbr->interval_delivered / elapsed);
+        int k;
+
+        //a sample from a spell the sender held back only counts if it
+        //shows more bandwidth than we knew of; otherwise it would drag the
+        //model down to however fast we chose to go.  pacing at a gain
+        //below 1 would then lower the rate, and so the next sample, for good
+        if(!bbr->interval_limited || sample >= bbr->max_bw){
+            bbr->bw_samples[bbr->bw_next] = sample;
+            bbr->bw_next = (bbr->bw_next + 1) % CC_BBR_BW_WINDOW;
+            bbr->max_bw = 0;
+            for(k = 0;k<CC_BBR_BW_WINDOW;k++){
+                bbr->max_bw = MAX(bbr->max_bw, bbr->bw_samples[k]);
+            }
+        }
+
+        bbr->interval_start = *now;
+        bbr->interval_delivered = 0;
+        bbr->interval_limited = false;
+        bbr_end_round(cc, in_flight);
+    }
+
+    if(bbr->mode == BBR_STARTUP && bbr_bdp(cc) == 0){
+        //grow like slow start until there's a model to go on
+        cc->cwnd = clamp_cwnd((double) cc->cwnd + acked, cc->mss);
+    } else {
+        bbr_set_cwnd(cc);
+    }
+}
+
+static void bbr_on_loss(cc_state_t *cc, uint32_t in_flight, const struct timespec *now){
+    //loss isn't a congestion signal for bbr, the model already bounds cwnd
+}
+
+static void bbr_on_dupack(cc_state_t *cc){
+}
+
+static void bbr_on_recovered(cc_state_t *cc){
+    bbr_set_cwnd(cc);
+}
+
+static void bbr_on_rto(cc_state_t *cc, uint32_t in_flight){
+    //start over from a small window; the next ack restores the model's cwnd
+    cc->cwnd = 4 * cc->mss;
+    cc->u.bbr.interval_valid = false;
+}
+
+static uint64_t bbr_pacing_rate(cc_state_t *cc){
+    return (uint64_t)(cc->u.bbr.pacing_gain * cc->u.bbr.max_bw);
+}
+
+const cc_ops_t cc_bbr = {
+    "bbr",
+    bbr_init,
+    bbr_on_ack,
+    bbr_on_loss,
+    bbr_on_dupack,
+    bbr_on_recovered,
+    bbr_on_rto,
+    bbr_pacing_rate
+};
+
+
+void cc_init(cc_state_t *cc, int algorithm, uint32_t mss){
+    assert(cc && mss > 0);
+
+    memset(cc, 0, sizeof(*cc));
+    switch(algorithm){
+        case MYCC_CUBIC: cc->ops = &cc_cubic; break;
+        case MYCC_BBR: cc->ops = &cc_bbr; break;
+        default: cc->ops = &cc_reno; break;
+    }
+    cc->mss = mss;
+    cc->last_rtt = -1;
+    cc->ops->init(cc);
+}
@@ -0,0 +1,136 @@
+/* congestion.h--congestion control for the STCP transport layer.
+ *
+ * the transport keeps one cc_state_t per connection and tells it about
+ * acks, losses and timeouts; the algorithm behind it (chosen with the
+ * MYSO_CONGESTION socket option) decides the congestion window and,
+ * optionally, the rate at which segments should leave.
+ */
+
+#ifndef __CONGESTION_H__
+#define __CONGESTION_H__
+
+#include <time.h>
+#include "mysock.h"
+
+#define CC_BBR_BW_WINDOW 10    /* rounds the bandwidth max filter covers */
+
+struct cc_state;
+
+/* the hooks every algorithm implements.  in_flight is the number of bytes
+ * sent but not yet acked, rtt is a fresh sample in microseconds or -1 when
+ * the ack couldn't be timed (Karn's rule).
+ */
+typedef struct cc_ops
+{
+    const char *name;
+
+    void (*init)(struct cc_state *cc);
+
+    /* new data was cumulatively acked */
+    void (*on_ack)(struct cc_state *cc, uint32_t acked, uint32_t in_flight,
+                   long rtt, bool in_recovery, const struct timespec *now);
+
+    /* fast retransmit: a loss was detected from duplicate acks */
+    void (*on_loss)(struct cc_state *cc, uint32_t in_flight,
+                    const struct timespec *now);
+
+    /* another duplicate ack arrived while recovering */
+    void (*on_dupack)(struct cc_state *cc);
+
+    /* everything outstanding at the loss has been acked */
+    void (*on_recovered)(struct cc_state *cc);
+
+    /* the retransmission timer went off */
+    void (*on_rto)(struct cc_state *cc, uint32_t in_flight);
+
+    /* bytes per second segments should be paced at, 0 if the algorithm
+     * leaves that to the transport
+     */
+    uint64_t (*pacing_rate)(struct cc_state *cc);
+} cc_ops_t;
+
+typedef enum
+{
+    BBR_STARTUP,
+    BBR_DRAIN,
+    BBR_PROBE_BW
+} bbr_mode_t;
+
+typedef struct
+{
+    double w_max;               /* window (bytes) before the last reduction */
+    double k;                   /* seconds until the cubic reaches w_max */
+    double origin;              /* window the cubic curve is centred on */
+    double w_est;               /* what Reno would have by now */
+    bool epoch_valid;
+    struct timespec epoch_start;
+} cubic_state_t;
+
+typedef struct
+{
+    bbr_mode_t mode;
+
+    //delivery rate samples, bytes per second
+    uint64_t bw_samples[CC_BBR_BW_WINDOW];
+    int bw_next;
+    uint64_t max_bw;
+
+    long min_rtt;               /* microseconds, -1 until sampled */
+    struct timespec min_rtt_stamp;
+
+    //the interval the current rate sample is being measured over
+    bool interval_valid;
+    struct timespec interval_start;
+    uint32_t interval_delivered;
+
+    //startup exits once bandwidth stops growing
+    uint64_t full_bw;
+    int full_bw_rounds;
+
+    int drain_rounds;           /* rounds spent in DRAIN */
+    bool interval_limited;      /* the sender held back during the interval */
+
+    int cycle_index;            /* position in the PROBE_BW gain cycle */
+    double pacing_gain;
+    double cwnd_gain;
+} bbr_state_t;
+
+typedef struct cc_state
+{
+    const cc_ops_t *ops;
+
+    uint32_t mss;
+    uint32_t cwnd;              /* bytes */
+    uint32_t ssthresh;          /* bytes */
+    uint32_t bytes_acked;       /* congestion avoidance byte counting */
+    long last_rtt;              /* most recent sample, microseconds */
+
+    /* set by the transport when it had room to send but didn't, because
+     * the app had nothing for it or the pacer held a segment back; the
+     * algorithm clears it once it has taken note.  a delivery rate
+     * measured over such a spell says how fast the sender went, not how
+     * fast the path can go
+     */
+    bool send_limited;
+
+    union
+    {
+        cubic_state_t cubic;
+        bbr_state_t bbr;
+    } u;
+} cc_state_t;
+
+
+extern const cc_ops_t cc_reno;
+extern const cc_ops_t cc_cubic;
+extern const cc_ops_t cc_bbr;
+
+/* sets up cc for the given MYCC_* algorithm; unknown values get Reno */
+void cc_init(cc_state_t *cc, int algorithm, uint32_t mss);
+
+static inline uint32_t cc_cwnd(const cc_state_t *cc)
+{
+    return cc->cwnd;
+}
+
+#endif  /* __CONGESTION_H__ */
@@ -220,6 +220,7 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
 
         new_ctx = _mysock_get_context(queue_entry->sd);
         new_ctx->listen_sd = ctx->my_sd;
+        new_ctx->options   = ctx->options;
 
         new_ctx->network_state.peer_addr       = *peer_addr;
         new_ctx->network_state.peer_addr_len   = peer_addr_len;
@@ -238,11 +239,14 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
                                       &ctx->network_state,
                                       user_data, packet, packet_len);
 
-        _mysock_transport_init(queue_entry->sd, FALSE);
-
-        /* pass the SYN packet on to the main STCP code */
+        /* pass the SYN packet on to the main STCP code.  this goes in
+         * before the connection's network thread starts, as that thread
+         * must be the queue's only producer from then on.
+         */
         _mysock_enqueue_buffer(new_ctx, &new_ctx->network_recv_queue,
                                packet, packet_len);
+
+        _mysock_transport_init(queue_entry->sd, FALSE);
     }
     else
     {
@@ -10,6 +10,7 @@
 #include "mysock.h"
 #include "mysock_impl.h"
 #include "network_io.h"
+#include "stcp_log.h"
 #include "stcp_api.h"
 #include "transport.h"
 
@@ -73,6 +74,35 @@ mysock_context_t *_mysock_get_context(mysocket_t sd)
         ? global_ctx[sd] : NULL;
 }
 
+/* get the network receive queue's pool ready for a connection, before the
+ * network thread starts on it:  a buffer of each class a packet may be
+ * copied into, and, if the receive buffer is fixed, enough for the
+ * network thread to land a full window of full-size packets, plus the one
+ * it's landing and one on its way up.  an autotuned buffer grows with no
+ * set end, and the pool with it.
+ */
+static void _mysock_reserve_recv_pool(mysock_context_t *ctx)
+{
+    packet_pool_t *pool = &ctx->network_recv_queue.pool;
+    size_t landing_len = MIN(_network_max_packet_len(&ctx->network_state),
+                             MAX_PACKET_LEN);
+    size_t len, window;
+
+    for (len = 0; 2 * _packet_buf_size_for(len) <= landing_len;
+         len = _packet_buf_size_for(len) + 1)
+    {
+        _packet_pool_reserve(pool, len, 1);
+    }
+
+    /* the buffer's size is rounded up to a power of two */
+    for (window = 1; ctx->options.rcvbuf > 0 &&
+                     window < (size_t) ctx->options.rcvbuf; window <<= 1)
+        ;
+    _packet_pool_reserve(pool, landing_len,
+                         ctx->options.rcvbuf > 0 ?
+                         window / landing_len + 2 : 1);
+}
+
 /* initiate a new STCP connection; called by myconnect() and myaccept() */
 void _mysock_transport_init(mysocket_t sd, bool_t is_active)
 {
@@ -80,6 +110,7 @@ void _mysock_transport_init(mysocket_t sd, bool_t is_active)
 
     assert(!connection_context->listening);
     connection_context->is_active = is_active;
+    _mysock_reserve_recv_pool(connection_context);
 
     /* start a new network thread; this handles incoming data, passing it
      * up to the transport layer.  (the network input is threaded so we can
@@ -117,15 +148,191 @@ int _mysock_wait_for_connection(mysock_context_t *ctx)
 }
 
 
+/* block until the queue has something in it (for_data) or has room (or
+ * nobody left to read it).
+ */
+static void _mysock_queue_wait(packet_queue_t *pq, bool_t for_data)
+{
+    wake_channel_t *ch = for_data ? pq->consumer_ch : pq->producer_ch;
+
+    for (;;)
+    {
+        uint32_t seq = _wake_channel_prepare(ch, for_data ?
+                                             pq->consumer_events :
+                                             pq->producer_events);
+
+        if (for_data ? !_mysock_queue_empty(pq) :
+            (!_mysock_queue_full(pq) ||
+             pq->closed.load(std::memory_order_acquire)))
+            break;
+        (void) _wake_channel_sleep(ch, seq, NULL);
+    }
+    _wake_channel_finish(ch);
+}
+
+/* is there a free slot at the tail of pq?  producer only. */
+static bool_t _mysock_queue_room(packet_queue_t *pq)
+{
+    uint32_t tail = pq->tail.load(std::memory_order_relaxed);
+
+    if (tail - pq->head_cache >= PACKET_QUEUE_LEN)
+        pq->head_cache = pq->head.load(std::memory_order_acquire);
+    return tail - pq->head_cache < PACKET_QUEUE_LEN;
+}
+
+/* the next free entry on pq's spill list, making room for one if need be */
+static packet_queue_node_t *_mysock_queue_spill(packet_queue_t *pq)
+{
+    if (pq->spill_head + pq->spill_len == pq->spill_cap)
+    {
+        if (pq->spill_head > 0 && pq->spill_head >= pq->spill_cap / 2)
+        {
+            memmove(pq->spill, pq->spill + pq->spill_head,
+                    pq->spill_len * sizeof(*pq->spill));
+            pq->spill_head = 0;
+        }
+        else
+        {
+            pq->spill_cap = pq->spill_cap ? 2 * pq->spill_cap :
+                            PACKET_QUEUE_LEN;
+            pq->spill = (packet_queue_node_t *)
+                realloc(pq->spill, pq->spill_cap * sizeof(*pq->spill));
+            assert(pq->spill);
+        }
+    }
+
+    pq->spilling = TRUE;
+    return &pq->spill[pq->spill_head + pq->spill_len];
+}
+
+/* the next free slot at the tail of pq, waiting for room if need be (or
+ * spilling, if the queue's producer mustn't wait), or NULL if the consumer
+ * has gone.  producer only.
+ */
+static packet_queue_node_t *_mysock_queue_tail(mysock_context_t *ctx,
+                                               packet_queue_t   *pq)
+{
+    if (pq->spill_len > 0)
+        (void) _mysock_flush_queue(ctx, pq, FALSE);
+
+    if (pq->closed.load(std::memory_order_acquire))
+        return NULL;
+
+    /* anything still spilled goes in ahead of this */
+    if (pq->spill_len == 0)
+    {
+        if (!_mysock_queue_room(pq))
+        {
+            if (pq->may_spill)
+                return _mysock_queue_spill(pq);
+
+            _mysock_queue_wait(pq, FALSE);
+            if (pq->closed.load(std::memory_order_acquire))
+                return NULL;
+            pq->head_cache = pq->head.load(std::memory_order_acquire);
+        }
+        return &pq->slots[pq->tail.load(std::memory_order_relaxed) &
+                          (PACKET_QUEUE_LEN - 1)];
+    }
+    return _mysock_queue_spill(pq);
+}
+
+/* hand the slot _mysock_queue_tail() gave us over to the consumer, or
+ * leave it spilled
+ */
+static void _mysock_queue_push(mysock_context_t *ctx, packet_queue_t *pq)
+{
+    uint32_t tail = pq->tail.load(std::memory_order_relaxed);
+    packet_queue_node_t *node = pq->spilling ?
+        &pq->spill[pq->spill_head + pq->spill_len] :
+        &pq->slots[tail & (PACKET_QUEUE_LEN - 1)];
+
+    pq->bytes_in.store(pq->bytes_in.load(std::memory_order_relaxed) +
+                       node->data_len, std::memory_order_relaxed);
+    if (pq->spilling)
+    {
+        pq->spilling = FALSE;
+        ++pq->spill_len;
+        return;
+    }
+    pq->tail.store(tail + 1, std::memory_order_release);
+    _wake_channel_wake(pq->consumer_ch, pq->consumer_events);
+}
+
+/* the slot at the head of pq, waiting for one if need be.  consumer only. */
+static packet_queue_node_t *_mysock_queue_head(mysock_context_t *ctx,
+                                               packet_queue_t   *pq)
+{
+    uint32_t head = pq->head.load(std::memory_order_relaxed);
+
+    if (head == pq->tail_cache)
+    {
+        pq->tail_cache = pq->tail.load(std::memory_order_acquire);
+        if (head == pq->tail_cache)
+        {
+            _mysock_queue_wait(pq, TRUE);
+            pq->tail_cache = pq->tail.load(std::memory_order_acquire);
+        }
+    }
+    return &pq->slots[head & (PACKET_QUEUE_LEN - 1)];
+}
+
+/* len bytes have been taken from the head slot; once that's all of it,
+ * the slot goes back to the producer
+ */
+static void _mysock_queue_consume(mysock_context_t *ctx,
+                                  packet_queue_t   *pq,
+                                  size_t            len,
+                                  bool_t            whole)
+{
+    pq->bytes_out.store(pq->bytes_out.load(std::memory_order_relaxed) + len,
+                        std::memory_order_release);
+    if (whole)
+    {
+        pq->head.store(pq->head.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_release);
+        _wake_channel_wake(pq->producer_ch, pq->producer_events);
+    }
+}
+
+/* copy n bytes from the front of the head slot to dst and take them off
+ * the queue.  this just moves the slot's cursor along, unless that's all of
+ * it.
+ */
+static void _mysock_queue_take(mysock_context_t    *ctx,
+                               packet_queue_t      *pq,
+                               packet_queue_node_t *node,
+                               void                *dst,
+                               size_t               n)
+{
+    assert(n <= node->data_len);
+
+    memcpy(dst, node->data, n);
+    if (n < node->data_len)
+    {
+        node->data += n;
+        node->data_len -= n;
+        _mysock_queue_consume(ctx, pq, n, FALSE);
+    }
+    else
+    {
+        _packet_buf_release(node->buf);
+        node->buf = NULL;
+        _mysock_queue_consume(ctx, pq, n, TRUE);
+    }
+}
+
 /* add an incoming buffer (packet) to a queue for this connection; it will be
  * dequeued by stcp_network_recv() or myread() when the transport layer or
  * application is ready to use it, depending on the queue to which
- * the buffer (or packet) is added.
+ * the buffer (or packet) is added.  if the queue is full, this blocks until
+ * the consumer makes room; if the consumer has gone (_mysock_close_queue()),
+ * the buffer is dropped.
  *
- * in the interest of simplicity (and since we aren't writing a high
- * performance TCP stack), this just copies the specified buffer for its own
- * use, so the calling code can do whatever it wants with the packet
- * afterwards.  the copied buffer is freed later by dequeue_buffer().
+ * this copies the specified buffer into one from the queue's pool, so the
+ * calling code can do whatever it wants with the packet afterwards.  data
+ * that's already in a packet_buf_t can go in by reference instead, with
+ * _mysock_enqueue_ref().
  */
 void _mysock_enqueue_buffer(mysock_context_t *ctx,
                             packet_queue_t   *pq,
@@ -136,32 +343,39 @@ void _mysock_enqueue_buffer(mysock_context_t *ctx,
 
     assert(ctx && pq && (packet || !packet_len));
 
-    node = (packet_queue_node_t *) calloc(1, sizeof(packet_queue_node_t));
-    assert(node);
-
-    node->data = (char *) malloc(packet_len * sizeof(char));
-    assert(node->data);
+    if (!(node = _mysock_queue_tail(ctx, pq)))
+        return;
 
+    node->buf = _packet_buf_alloc(&pq->pool, packet_len);
+    node->data = node->buf->data;
     if (packet_len > 0)
         memcpy(node->data, packet, packet_len);
     node->data_len = packet_len;
+    _mysock_queue_push(ctx, pq);
+}
 
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    if (!pq->head)
-    {
-        assert(!pq->tail);
-        pq->head = pq->tail = node;
-    }
-    else
-    {
-        assert(pq->tail);
-        assert(!pq->tail->next);
-        assert(!node->next);
-        pq->tail->next = node;
-        pq->tail = node;
-    }
-    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+/* queue data_len bytes at data, which lie in buf, without copying them.
+ * the queue takes a reference of its own to buf.
+ */
+void _mysock_enqueue_ref(mysock_context_t *ctx,
+                         packet_queue_t   *pq,
+                         packet_buf_t     *buf,
+                         const char       *data,
+                         size_t            data_len)
+{
+    packet_queue_node_t *node;
+
+    assert(ctx && pq && buf);
+    assert(data >= buf->data && data + data_len <= buf->data + buf->size);
+
+    if (!(node = _mysock_queue_tail(ctx, pq)))
+        return;
+
+    _packet_buf_hold(buf);
+    node->buf = buf;
+    node->data = (char *) data;
+    node->data_len = data_len;
+    _mysock_queue_push(ctx, pq);
 }
 
 /* remove one packet from the head of the waiting packet queue, copying the
@@ -182,76 +396,241 @@ size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
 
     assert(ctx && pq && dst);
 
-    /* block until queue is non-empty */
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
-    while (!pq->head)
-    {
-        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
-                                       &ctx->data_ready_lock));
-    }
-
-    node = pq->head;
-    assert(node && node->data);
+    node = _mysock_queue_head(ctx, pq);
+    assert(node->buf);
 
     if (node->data_len > max_len && remove_partial)
     {
         /* remove only a portion of the packet at the head of the queue,
          * leaving the rest around for the next call to dequeue_buffer().
+         * the slot stays ours, so the producer can't touch it meanwhile.
          */
-        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-
-        memcpy(dst, node->data, max_len);
-        memmove(node->data, node->data + max_len, node->data_len - max_len);
-        node->data_len -= max_len;
+        _mysock_queue_take(ctx, pq, node, dst, max_len);
         packet_len = max_len;
     }
     else
     {
         /* dequeue the entire packet at the head of the queue */
-        if (!(pq->head = pq->head->next))
+        memcpy(dst, node->data, MIN(max_len, node->data_len));
+        packet_len = node->data_len;
+
+        _packet_buf_release(node->buf);
+        node->buf = NULL;
+        _mysock_queue_consume(ctx, pq, packet_len, TRUE);
+    }
+
+    return packet_len;
+}
+
+/* remove the packet at the head of the queue without copying it:  *data
+ * points at its payload, which lies in *buf, and the queue's reference to
+ * *buf passes to the caller, who must _packet_buf_release() it.  returns
+ * the payload's length.
+ */
+size_t _mysock_dequeue_ref(mysock_context_t *ctx,
+                           packet_queue_t   *pq,
+                           packet_buf_t    **buf,
+                           char            **data)
+{
+    packet_queue_node_t *node;
+    size_t               packet_len;
+
+    assert(ctx && pq && buf && data);
+
+    node = _mysock_queue_head(ctx, pq);
+    assert(node->buf);
+
+    *buf = node->buf;
+    *data = node->data;
+    packet_len = node->data_len;
+
+    node->buf = NULL;
+    _mysock_queue_consume(ctx, pq, packet_len, TRUE);
+    return packet_len;
+}
+
+/* remove bytes from the queue up to and including the next "\r\n" (which
+ * may straddle two packets), or until max_len bytes have been copied to
+ * dst, whichever comes first; this blocks until one of them does, or the
+ * data runs out (a zero-length packet).  returns the number of bytes
+ * copied, 0 only at the end of the data.
+ */
+size_t _mysock_dequeue_line(mysock_context_t *ctx,
+                            packet_queue_t   *pq,
+                            void             *dst,
+                            size_t            max_len)
+{
+    char  *out = (char *) dst;
+    size_t copied = 0;
+    bool_t found = FALSE;
+
+    assert(ctx && pq && dst);
+
+    while (!found && copied < max_len)
+    {
+        packet_queue_node_t *node = _mysock_queue_head(ctx, pq);
+        const char *scan, *end, *nl;
+        size_t n;
+
+        assert(node->buf);
+        if (node->data_len == 0)
         {
-            assert(pq->tail == node);
-            pq->tail = NULL;
+            /* the end of the data:  hand back what we have first */
+            if (copied == 0)
+                _mysock_queue_take(ctx, pq, node, out, 0);
+            break;
         }
-        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
 
-        memcpy(dst, node->data, MIN(max_len, node->data_len));
-        packet_len = node->data_len;
+        n = MIN(node->data_len, max_len - copied);
+        scan = node->data;
+        end = node->data + n;
+        while ((nl = (const char *) memchr(scan, '\n', end - scan)) != NULL)
+        {
+            char prev = (nl > node->data) ? nl[-1] :
+                        (copied > 0) ? out[copied - 1] : '\0';
+
+            if (prev == '\r')
+            {
+                n = nl + 1 - node->data;
+                found = TRUE;
+                break;
+            }
+            scan = nl + 1;
+        }
+
+        _mysock_queue_take(ctx, pq, node, out + copied, n);
+        copied += n;
+    }
+
+    return copied;
+}
+
+/* copy up to max_len bytes from the front of the queue to dst without
+ * removing them, blocking until there's something there.  stops short at
+ * the end of the data (a zero-length packet).  returns the number of bytes
+ * copied.
+ */
+size_t _mysock_peek_buffer(mysock_context_t *ctx,
+                           packet_queue_t   *pq,
+                           void             *dst,
+                           size_t            max_len)
+{
+    uint32_t head, tail;
+    size_t copied = 0;
+
+    assert(ctx && pq && dst);
+
+    (void) _mysock_queue_head(ctx, pq);
+    head = pq->head.load(std::memory_order_relaxed);
+    tail = pq->tail_cache = pq->tail.load(std::memory_order_acquire);
+
+    for (; head != tail && copied < max_len; ++head)
+    {
+        packet_queue_node_t *node = &pq->slots[head & (PACKET_QUEUE_LEN - 1)];
+        size_t n;
 
-        free(node->data);
+        if (node->data_len == 0)
+            break;
 
-        memset(node, 0, sizeof(*node));
-        free(node);
+        n = MIN(node->data_len, max_len - copied);
+        memcpy((char *) dst + copied, node->data, n);
+        copied += n;
     }
 
-    return packet_len;
+    return copied;
+}
+
+/* move what pq's producer has spilled into the ring, as far as there's
+ * room for it, or all of it if wait is set, waiting for the consumer to
+ * make room.  once the consumer has gone, it's dropped instead.  returns
+ * TRUE if some is still spilled.  producer only.
+ */
+bool_t _mysock_flush_queue(mysock_context_t *ctx,
+                           packet_queue_t   *pq,
+                           bool_t            wait)
+{
+    assert(ctx && pq);
+
+    while (pq->spill_len > 0)
+    {
+        uint32_t tail = pq->tail.load(std::memory_order_relaxed);
+        uint32_t moved = 0;
+
+        if (pq->closed.load(std::memory_order_acquire))
+        {
+            for (; pq->spill_len > 0; --pq->spill_len)
+                _packet_buf_release(pq->spill[pq->spill_head++].buf);
+            break;
+        }
+
+        for (; pq->spill_len > 0 && _mysock_queue_room(pq); --pq->spill_len)
+        {
+            pq->slots[tail & (PACKET_QUEUE_LEN - 1)] =
+                pq->spill[pq->spill_head++];
+            pq->tail.store(++tail, std::memory_order_release);
+            ++moved;
+        }
+        if (moved > 0)
+            _wake_channel_wake(pq->consumer_ch, pq->consumer_events);
+
+        if (!wait || pq->spill_len == 0)
+            break;
+        _mysock_queue_wait(pq, FALSE);
+    }
+
+    if (pq->spill_len == 0)
+        pq->spill_head = 0;
+    return pq->spill_len > 0;
+}
+
+/* the consumer of pq is done with it:  anything enqueued from now on is
+ * dropped, and a producer waiting for room is let go.
+ */
+void _mysock_close_queue(mysock_context_t *ctx, packet_queue_t *pq)
+{
+    assert(ctx && pq);
+
+    pq->closed.store(true, std::memory_order_release);
+    _wake_channel_wake(pq->producer_ch, WAKE_ANY);
 }
 
 /* free any last buffers in the specified queue, discarding the contents.
  * this is called only when the mysocket context is being deallocated, so
- * there are no concerns about thread safety here.  returns TRUE if
+ * there are no concerns about thread safety here.  the queue's pool is left
+ * alone, as another queue may still hold some of its buffers.  returns TRUE if
  * non-zero-length buffers were deallocated, FALSE otherwise.
  */
 static bool_t _mysock_free_queue(mysock_context_t *ctx, packet_queue_t *pq)
 {
-    packet_queue_node_t *node;
+    uint32_t head, tail;
     bool_t result = FALSE;
 
     assert(ctx && pq);
-    result = (pq->head != NULL);
-    for (node = pq->head; node; )
+    head = pq->head.load(std::memory_order_relaxed);
+    tail = pq->tail.load(std::memory_order_relaxed);
+    for (; head != tail; ++head)
     {
-        packet_queue_node_t *next = node->next;
+        packet_queue_node_t *node = &pq->slots[head & (PACKET_QUEUE_LEN - 1)];
 
         if (node->data_len > 0)
             result = TRUE;
 
-        free(node->data);
-        free(node);
-        node = next;
+        _packet_buf_release(node->buf);
+        node->buf = NULL;
     }
 
-    pq->head = pq->tail = NULL;
+    pq->head.store(tail, std::memory_order_relaxed);
+
+    for (; pq->spill_len > 0; --pq->spill_len)
+    {
+        packet_queue_node_t *node = &pq->spill[pq->spill_head++];
+
+        if (node->data_len > 0)
+            result = TRUE;
+        _packet_buf_release(node->buf);
+    }
+    free(pq->spill);
+    pq->spill = NULL;
     return result;
 }
 
@@ -263,12 +642,20 @@ static mysock_context_t *_mysock_allocate_context(void)
 {
     mysock_context_t *ctx = 0;
 
-    ctx = (mysock_context_t *) calloc(1, sizeof(mysock_context_t));
-    assert(ctx);
+    /* the queues' indices are cache line aligned, so the context must be */
+    if (posix_memalign((void **) &ctx, CACHE_LINE_LEN,
+                       sizeof(mysock_context_t)) != 0)
+    {
+        assert(0);
+        abort();
+    }
+    memset((void *) ctx, 0, sizeof(*ctx));
 
     /* by default, sockets are active */
     ctx->listen_sd = -1;
 
+    ctx->options.delack_ms = MYDELACK_DEFAULT_MS;
+
     /* initialise connection condition variable.  this is signaled when the
      * connection is established, i.e. myconnect() or myaccept() should
      * unblock and return to the calling application.
@@ -276,10 +663,39 @@ static mysock_context_t *_mysock_allocate_context(void)
     PTHREAD_CALL(pthread_cond_init(&ctx->blocking_cond, NULL));
     PTHREAD_CALL(pthread_mutex_init(&ctx->blocking_lock, NULL));
 
-    /* initialise data ready condition variable.  this is signaled when
-     * data is ready from the application or the network.
+    /* initialise the wake channels.  STCP consumes from both the network
+     * and the app, and is woken on its own channel for either, but only
+     * for the one it's waiting on; myread() has one of its own.  producers
+     * wait on their queue's channel, except STCP, which only ever waits for
+     * room in the app's queue alongside everything else.  their timeouts are
+     * on CLOCK_MONOTONIC, so setting the system clock can't cut a wait short
+     * or drag it out.
+     */
+    _wake_channel_init(&ctx->transport_ch);
+    _wake_channel_init(&ctx->app_read_ch);
+    _wake_channel_init(&ctx->network_recv_queue.room_ch);
+    _wake_channel_init(&ctx->app_recv_queue.room_ch);
+
+    ctx->network_recv_queue.producer_ch = &ctx->network_recv_queue.room_ch;
+    ctx->network_recv_queue.producer_events = WAKE_ANY;
+    ctx->network_recv_queue.consumer_ch = &ctx->transport_ch;
+    ctx->network_recv_queue.consumer_events = NETWORK_DATA;
+    ctx->app_recv_queue.producer_ch = &ctx->app_recv_queue.room_ch;
+    ctx->app_recv_queue.producer_events = WAKE_ANY;
+    ctx->app_recv_queue.consumer_ch = &ctx->transport_ch;
+    ctx->app_recv_queue.consumer_events = APP_DATA;
+    ctx->app_send_queue.producer_ch = &ctx->transport_ch;
+    ctx->app_send_queue.producer_events = QUEUE_ROOM;
+    ctx->app_send_queue.consumer_ch = &ctx->app_read_ch;
+    ctx->app_send_queue.consumer_events = WAKE_ANY;
+    ctx->app_send_queue.may_spill = TRUE;
+
+    /* the app's data goes up in big buffers, leaving the zero-length one
+     * that marks its end as the only use of the smallest class.  carve
+     * that class up front, so the end of a transfer doesn't go to the heap.
      */
-    PTHREAD_CALL(pthread_cond_init(&ctx->data_ready_cond, NULL));
+    _packet_pool_reserve(&ctx->app_send_queue.pool, 0, 1);
+
     PTHREAD_CALL(pthread_mutex_init(&ctx->data_ready_lock, NULL));
 
     ctx->blocking = TRUE;   /* we unblock once we're connected */
@@ -311,7 +727,10 @@ void _mysock_free_context(mysock_context_t *ctx)
     PTHREAD_CALL(pthread_cond_destroy(&ctx->blocking_cond));
     PTHREAD_CALL(pthread_mutex_destroy(&ctx->blocking_lock));
 
-    PTHREAD_CALL(pthread_cond_destroy(&ctx->data_ready_cond));
+    _wake_channel_destroy(&ctx->transport_ch);
+    _wake_channel_destroy(&ctx->app_read_ch);
+    _wake_channel_destroy(&ctx->network_recv_queue.room_ch);
+    _wake_channel_destroy(&ctx->app_recv_queue.room_ch);
     PTHREAD_CALL(pthread_mutex_destroy(&ctx->data_ready_lock));
 
     /* free any last buffers that might be lying around (e.g. retransmitted
@@ -323,6 +742,19 @@ void _mysock_free_context(mysock_context_t *ctx)
     (void) _mysock_free_queue(ctx, &ctx->app_recv_queue);
     (void) _mysock_free_queue(ctx, &ctx->app_send_queue);
 
+    LOG_DEBUG("sd %d: pool hits/misses network %llu/%llu, app recv %llu/%llu, "
+              "app send %llu/%llu", ctx->my_sd,
+              POOL_COUNTERS(&ctx->network_recv_queue.pool),
+              POOL_COUNTERS(&ctx->app_recv_queue.pool),
+              POOL_COUNTERS(&ctx->app_send_queue.pool));
+
+    /* the app send queue can hold slices of network buffers, so the pools
+     * only go once all three queues have let go of everything
+     */
+    _packet_pool_destroy(&ctx->network_recv_queue.pool);
+    _packet_pool_destroy(&ctx->app_recv_queue.pool);
+    _packet_pool_destroy(&ctx->app_send_queue.pool);
+
     _network_close(&ctx->network_state);
 
     /* clear mysocket descriptor table entry */
@@ -330,7 +762,7 @@ void _mysock_free_context(mysock_context_t *ctx)
     if (global_ctx[sd] == ctx)
         global_ctx[sd] = 0;
 
-    memset(ctx, 0, sizeof(*ctx));
+    memset((void *) ctx, 0, sizeof(*ctx));
     free(ctx);
 }
 
@@ -386,6 +818,17 @@ static void *transport_thread_func(void *arg_ptr)
      * by the transport layer already in response to the peer's FIN).
      */
     _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, &eof_packet, 0);
+
+    /* nothing's left to move whatever STCP spilled up to the app, so wait
+     * for the app to make room for it (or close)
+     */
+    (void) _mysock_flush_queue(ctx, &ctx->app_send_queue, TRUE);
+
+    /* nobody's reading the network or the app's writes any more; don't let
+     * a full queue hold up the network thread or mywrite()
+     */
+    _mysock_close_queue(ctx, &ctx->network_recv_queue);
+    _mysock_close_queue(ctx, &ctx->app_recv_queue);
     return NULL;
 }
 
@@ -432,6 +875,82 @@ int _mysock_bind_ephemeral(mysock_context_t *ctx)
     return 0;
 }
 
+/* look up a mysetsockopt() value.  returns -1 for an unknown option. */
+int _mysock_get_option(mysock_context_t *ctx, int optname, int *value)
+{
+    assert(ctx && value);
+
+    switch (optname)
+    {
+    case MYSO_CONGESTION:
+        *value = ctx->options.congestion;
+        return 0;
+
+    case MYSO_DELACK:
+        *value = ctx->options.delack_ms;
+        return 0;
+
+    case MYSO_NODELAY:
+        *value = ctx->options.nodelay;
+        return 0;
+
+    case MYSO_CORK:
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        *value = ctx->options.cork;
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        return 0;
+
+    case MYSO_SNDBUF:
+        *value = ctx->options.sndbuf;
+        return 0;
+
+    case MYSO_RCVBUF:
+        *value = ctx->options.rcvbuf;
+        return 0;
+
+    case MYSO_KEEPALIVE:
+        *value = ctx->options.keepalive_s;
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+/* ask STCP to send everything the app has queued so far, full segment or
+ * not.  the request lasts until the queue has been drained.
+ */
+void _mysock_push_app_data(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->app_push = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    _wake_channel_wake(&ctx->transport_ch, APP_DATA);
+}
+
+/* the app has read some of what STCP passed up.  if that took it down to
+ * the drain mark, let STCP know.
+ */
+void _mysock_app_data_read(mysock_context_t *ctx)
+{
+    bool_t drained = FALSE;
+
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    if (ctx->app_drain_wanted &&
+        _mysock_queue_bytes(&ctx->app_send_queue) <= ctx->app_drain_mark)
+    {
+        ctx->app_drain_wanted = FALSE;
+        ctx->app_drained = drained = TRUE;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    if (drained)
+        _wake_channel_wake(&ctx->transport_ch, APP_DRAINED);
+}
+
 /* create a detached thread */
 pthread_t _mysock_create_thread(void *(*start)(void *args), void *args,
                                 bool_t create_detached)
@@ -35,6 +35,51 @@ typedef int mysocket_t;     /* mysocket descriptor */
 #endif
 
 
+/* per-mysocket options for mysetsockopt()/mygetsockopt().  these are read
+ * when the connection is set up, so set them before myconnect(), or on the
+ * listening mysocket before mylisten()--accepted mysockets inherit the
+ * options of the mysocket they were accepted on.
+ */
+#define MYSO_CONGESTION 1   /* congestion control algorithm, MYCC_* */
+#define MYSO_DELACK     2   /* delayed ack timer in milliseconds, 0 acks
+                             * every segment straight away */
+#define MYSO_NODELAY    3   /* non-zero turns off Nagle's algorithm, so small
+                             * writes go out even while data is unacked */
+#define MYSO_CORK       4   /* non-zero holds back everything short of a
+                             * full segment.  unlike the others this can be
+                             * changed at any time; clearing it sends
+                             * whatever is left, as does myflush() */
+#define MYSO_SNDBUF     5   /* send/receive buffer sizes in bytes, rounded */
+#define MYSO_RCVBUF     6   /* up to a power of two.  0 (the default) sizes
+                             * them from the measured bandwidth-delay
+                             * product instead */
+#define MYSO_KEEPALIVE  7   /* seconds the connection may sit idle before
+                             * we start probing the peer to see whether
+                             * it's still there.  0 (the default) never
+                             * probes */
+
+/* congestion control algorithms */
+#define MYCC_RENO   0       /* default */
+#define MYCC_CUBIC  1
+#define MYCC_BBR    2
+
+/* the MYCC_* value for an algorithm's name ("reno", "cubic" or "bbr"), for
+ * parsing a command line, or -1 if there's none by that name
+ */
+extern int mycongestion_by_name(const char *name);
+
+/* delayed acks */
+#define MYDELACK_DEFAULT_MS 40
+#define MYDELACK_MAX_MS     500     /* RFC 1122 limit */
+
+/* limits on MYSO_SNDBUF and MYSO_RCVBUF */
+#define MYBUF_MIN   2048
+#define MYBUF_MAX   (16 * 1024 * 1024)
+
+/* limit on MYSO_KEEPALIVE */
+#define MYKEEPALIVE_MAX_S   (24 * 60 * 60)
+
+
 extern mysocket_t mysocket();
 extern int mybind(mysocket_t sd, struct sockaddr *addr, int addrlen);
 extern int mylisten(mysocket_t sd, int backlog);
@@ -43,6 +88,17 @@ extern int myaccept(mysocket_t sd, struct sockaddr* addr, int *addrlen);
 extern int myclose(mysocket_t sd);
 extern int myread(mysocket_t sd, void *buffer, size_t length);
 extern int mywrite(mysocket_t sd, const void *buffer, size_t length);
+
+/* read one line of NVT ASCII, up to and including its "\r\n", into buffer.
+ * returns the number of bytes read, which end in "\r\n" unless the line
+ * didn't fit in length bytes or the connection ended first; 0 at EOF.
+ */
+extern int myreadline(mysocket_t sd, void *buffer, size_t length);
+
+/* copy what the next myread() would return into buffer, up to length
+ * bytes, leaving it to be read.  blocks until there's data; 0 at EOF.
+ */
+extern int mypeek(mysocket_t sd, void *buffer, size_t length);
 extern int mygetsockname(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
 extern int mygetpeername(mysocket_t sd, struct sockaddr *addr,
@@ -53,5 +109,13 @@ extern int mygetpeername(mysocket_t sd, struct sockaddr *addr,
  */
 extern uint32_t mylocalip(uint32_t peer_addr);
 
+extern int mysetsockopt(mysocket_t sd, int optname, int value);
+extern int mygetsockopt(mysocket_t sd, int optname, int *value);
+
+/* send whatever mywrite() has queued without waiting for a full segment,
+ * even if Nagle's algorithm or MYSO_CORK would otherwise hold it back.
+ */
+extern int myflush(mysocket_t sd);
+
 #endif  /* __MYSOCK_H__ */
 
@@ -169,7 +169,10 @@ int myclose(mysocket_t sd)
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
     ctx->close_requested = TRUE;
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-    PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+    _wake_channel_wake(&ctx->transport_ch, WAKE_ANY);
+
+    /* we won't be reading anything more STCP passes up */
+    _mysock_close_queue(ctx, &ctx->app_send_queue);
 
     /* block until STCP thread exits */
     if (ctx->transport_thread_started)
@@ -203,9 +206,12 @@ int mywrite(mysocket_t sd, const void *buf, size_t buf_len)
     MYSOCK_CHECK(!ctx->listening, EINVAL);
 
     assert(!ctx->close_requested);
-    _mysock_enqueue_buffer(ctx, &ctx->app_recv_queue, buf, buf_len);
+    if (buf_len > 0)
+        _mysock_enqueue_buffer(ctx, &ctx->app_recv_queue, buf, buf_len);
 
-    /* XXX: all bytes are queued, irrespective of current sender window */
+    /* XXX: all bytes are queued, irrespective of current sender window (we
+     * only block if the app has a whole queue's worth of writes pending)
+     */
     return buf_len;
 }
 
@@ -228,10 +234,57 @@ int myread(mysocket_t sd, void *buf, size_t buf_len)
         /* make sure repeated calls to myread() return 0 on EOF */
         ctx->eof = TRUE;
     }
+    else
+    {
+        _mysock_app_data_read(ctx);
+    }
 
     return len;
 }
 
+int myreadline(mysocket_t sd, void *buf, size_t buf_len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    int len;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+
+    assert(!ctx->close_requested);
+
+    if (ctx->eof || buf_len == 0)
+        return 0;
+
+    if ((len = _mysock_dequeue_line(ctx, &ctx->app_send_queue,
+                                    buf, buf_len)) == 0)
+    {
+        /* make sure repeated calls return 0 on EOF, as with myread() */
+        ctx->eof = TRUE;
+    }
+    else
+    {
+        _mysock_app_data_read(ctx);
+    }
+
+    return len;
+}
+
+int mypeek(mysocket_t sd, void *buf, size_t buf_len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+
+    assert(!ctx->close_requested);
+
+    if (ctx->eof || buf_len == 0)
+        return 0;
+
+    return (int) _mysock_peek_buffer(ctx, &ctx->app_send_queue,
+                                     buf, buf_len);
+}
+
 /* fills in addr with current port associated with the mysocket descriptor.
  * like the regular getsockname(), this does not fill in the local IP
  * address unless it's known.
@@ -279,6 +332,81 @@ int mygetpeername(mysocket_t sd, struct sockaddr *name, socklen_t *namelen)
     return 0;
 }
 
+/* set a per-mysocket option (see mysock.h) */
+int mysetsockopt(mysocket_t sd, int optname, int value)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+
+    switch (optname)
+    {
+    case MYSO_CONGESTION:
+        MYSOCK_CHECK(value == MYCC_RENO || value == MYCC_CUBIC ||
+                     value == MYCC_BBR, EINVAL);
+        ctx->options.congestion = value;
+        break;
+
+    case MYSO_DELACK:
+        MYSOCK_CHECK(value >= 0 && value <= MYDELACK_MAX_MS, EINVAL);
+        ctx->options.delack_ms = value;
+        break;
+
+    case MYSO_NODELAY:
+        ctx->options.nodelay = (value != 0);
+        break;
+
+    case MYSO_CORK:
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        ctx->options.cork = (value != 0);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        if (!value)
+            _mysock_push_app_data(ctx);
+        break;
+
+    case MYSO_SNDBUF:
+    case MYSO_RCVBUF:
+        MYSOCK_CHECK(value == 0 ||
+                     (value >= MYBUF_MIN && value <= MYBUF_MAX), EINVAL);
+        if (optname == MYSO_SNDBUF)
+            ctx->options.sndbuf = value;
+        else
+            ctx->options.rcvbuf = value;
+        break;
+
+    case MYSO_KEEPALIVE:
+        MYSOCK_CHECK(value >= 0 && value <= MYKEEPALIVE_MAX_S, EINVAL);
+        ctx->options.keepalive_s = value;
+        break;
+
+    default:
+        MYSOCK_ERROR_EXIT(ENOPROTOOPT);
+    }
+
+    return 0;
+}
+
+int myflush(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(!ctx->listening, EINVAL);
+
+    _mysock_push_app_data(ctx);
+    return 0;
+}
+
+int mygetsockopt(mysocket_t sd, int optname, int *value)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(value != NULL, EFAULT);
+    MYSOCK_CHECK(_mysock_get_option(ctx, optname, value) == 0, ENOPROTOOPT);
+    return 0;
+}
+
 /* returns IP address of interface on which packets to/from network address
  * peer_addr (network byte order) are delivered.
  */
@@ -287,3 +415,24 @@ uint32_t mylocalip(uint32_t peer_addr)
     return _network_get_interface_ip(peer_addr);
 }
 
+int mycongestion_by_name(const char *name)
+{
+    static const struct
+    {
+        const char *name;
+        int         congestion;
+    } algorithms[] =
+    {
+        { "reno",  MYCC_RENO  },
+        { "cubic", MYCC_CUBIC },
+        { "bbr",   MYCC_BBR   }
+    };
+    size_t i;
+
+    for (i = 0; name && i < sizeof(algorithms) / sizeof(algorithms[0]); ++i)
+    {
+        if (!strcmp(name, algorithms[i].name))
+            return algorithms[i].congestion;
+    }
+    return -1;
+}
@@ -12,8 +12,12 @@
 #include <errno.h>
 #include <assert.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <atomic>
 #include "mysock.h"
 #include "network_io.h"
+#include "packet_pool.h"
+#include "wake_channel.h"
 
 #ifdef __GNUC__
     #define INLINE __inline__
@@ -48,20 +52,114 @@ static INLINE void _pthread_call(int pthread_retval)
 #endif
 
 
-/* packet/buffer queue */
+/* packet/buffer queue.  every queue has one producer thread and one
+ * consumer thread, so it's a bounded ring that needs no lock:  the producer
+ * only moves tail and the consumer only moves head, each on its own cache
+ * line, and each side keeps a copy of the other's index so it only has to
+ * look at the other's line when the copy says the ring is full (or empty).
+ * a side that has to wait sleeps on a wake channel, which the other side
+ * rings only if it's asleep there.  STCP's channel is its thread's, as it
+ * waits on two queues (and the app's requests) at once; the others' are
+ * the queue's own.
+ *
+ * STCP mustn't ever block on the queue up to the app, or it would stop
+ * acking (and taking the app's own writes) until the app read, so when
+ * that ring is full its producer holds what it adds back on a spill list
+ * of its own, and moves it into the ring as room turns up.  spilled bytes
+ * count as queued, so the receive window covers them.
+ */
+#define PACKET_QUEUE_LEN    1024    /* slots per queue, a power of two */
+static_assert(POOL_CLASS_BUFS >= PACKET_QUEUE_LEN,
+              "a pool class must cover a full queue");
+
+/* what a producer with data spilled waits for on its channel; clear of
+ * the STCP events
+ */
+#define QUEUE_ROOM          0x80000000u
+
+/* a slot holds a reference to the buffer its data is in, and may be just
+ * a slice of it
+ */
 typedef struct packet_queue_node
 {
-    char                     *data;
-    size_t                    data_len;
-    struct packet_queue_node *next;
+    packet_buf_t *buf;
+    char         *data;
+    size_t        data_len;
 } packet_queue_node_t;
 
 typedef struct
 {
-    packet_queue_node_t *head;
-    packet_queue_node_t *tail;
+    /* producer's side */
+    alignas(CACHE_LINE_LEN) std::atomic<uint32_t> tail;  /* next slot filled */
+    uint32_t                head_cache;
+    std::atomic<size_t>     bytes_in;   /* total data_len ever queued */
+    packet_queue_node_t    *spill;      /* held back, oldest at spill_head */
+    uint32_t                spill_head;
+    uint32_t                spill_len;  /* past spill_head */
+    uint32_t                spill_cap;
+    bool_t                  may_spill;  /* rather than wait for room */
+    bool_t                  spilling;   /* the slot being filled is a spill */
+
+    /* consumer's side */
+    alignas(CACHE_LINE_LEN) std::atomic<uint32_t> head;  /* next slot emptied */
+    uint32_t                tail_cache;
+    std::atomic<size_t>     bytes_out;  /* ...and taken off again */
+
+    /* where each side sleeps, and what it waits for there */
+    wake_channel_t         *producer_ch;
+    unsigned int            producer_events;
+    wake_channel_t         *consumer_ch;
+    unsigned int            consumer_events;
+    wake_channel_t          room_ch;    /* producer_ch, unless it has another */
+    std::atomic<bool>       closed;     /* consumer's gone; drop new data */
+
+    packet_queue_node_t     slots[PACKET_QUEUE_LEN];
+
+    /* where the producer's buffers come from */
+    packet_pool_t           pool;
 } packet_queue_t;
 
+/* these may be called from any thread, but are only exact from the
+ * producer's or consumer's own.
+ */
+static INLINE size_t _mysock_queue_bytes(const packet_queue_t *pq)
+{
+    /* bytes_out first:  bytes_in can only have grown by the time we read
+     * it, so the difference never goes negative
+     */
+    size_t out = pq->bytes_out.load(std::memory_order_acquire);
+    return pq->bytes_in.load(std::memory_order_acquire) - out;
+}
+
+static INLINE uint32_t _mysock_queue_len(const packet_queue_t *pq)
+{
+    uint32_t head = pq->head.load(std::memory_order_acquire);
+    return pq->tail.load(std::memory_order_acquire) - head;
+}
+
+static INLINE bool_t _mysock_queue_empty(const packet_queue_t *pq)
+{
+    return _mysock_queue_len(pq) == 0;
+}
+
+static INLINE bool_t _mysock_queue_full(const packet_queue_t *pq)
+{
+    return _mysock_queue_len(pq) >= PACKET_QUEUE_LEN;
+}
+
+/* options set with mysetsockopt() */
+typedef struct
+{
+    int congestion;     /* MYSO_CONGESTION */
+    int delack_ms;      /* MYSO_DELACK */
+    int nodelay;        /* MYSO_NODELAY */
+    int cork;           /* MYSO_CORK; under data_ready_lock, as STCP
+                         * reads it while the app may change it */
+    int sndbuf;         /* MYSO_SNDBUF, 0 to autotune */
+    int rcvbuf;         /* MYSO_RCVBUF, 0 to autotune */
+    int keepalive_s;    /* MYSO_KEEPALIVE, 0 for none */
+} mysock_options_t;
+
 /* mysocket context (and the arguments provided to the transport layer
  * thread).  most of this is mysock/network layer working state, with STCP
  * working state maintained separately by the student.  there is one instance
@@ -88,6 +186,9 @@ typedef struct mysock_context
      */
     mysocket_t listen_sd;
 
+    /* options from mysetsockopt(), read by the transport layer */
+    mysock_options_t options;
+
     /* block application until connected (or an error) */
     pthread_cond_t  blocking_cond;
     pthread_mutex_t blocking_lock;
@@ -98,16 +199,40 @@ typedef struct mysock_context
     pthread_t       transport_thread;
     bool_t          transport_thread_started;
 
-    /* is data ready from either network or the app? */
-    pthread_cond_t  data_ready_cond;
+    /* STCP sleeps on transport_ch for data from either network or the
+     * app, or for the app's requests below; myread() sleeps on app_read_ch.
+     * data_ready_lock guards the requests.
+     */
+    wake_channel_t  transport_ch;
+    wake_channel_t  app_read_ch;
     pthread_mutex_t data_ready_lock;
     bool_t          close_requested;    /* myclose() called by app? */
+
+    /* app data is only reported to STCP once this much is queued, unless
+     * the app has asked for it to be pushed out (myflush(), uncorking)
+     */
+    size_t          app_low_water;
+    bool_t          app_push;
+
+    /* STCP's send MSS, the low water mark a cork implies before STCP has
+     * set one itself
+     */
+    size_t          app_mss;
+
+    /* STCP is told (APP_DRAINED) once myread() leaves no more than
+     * app_drain_mark bytes unread, so it can open its window again
+     */
+    size_t          app_drain_mark;
+    bool_t          app_drain_wanted;
+    bool_t          app_drained;
     bool_t          eof;                /* true once peer finishes writing */
 
     /* data sent to peer is sent immediately, so no queue is needed for that
      * case.  we keep a queue for the other three cases:  data coming from
      * peer, data sent to the app for consumption with myread(), and data
-     * coming from the app via mywrite().
+     * coming from the app via mywrite().  the network thread feeds the
+     * first and STCP takes from it; STCP feeds the second for myread(); the
+     * app feeds the third for STCP.
      */
     packet_queue_t  network_recv_queue; /* data coming from peer */
     packet_queue_t  app_send_queue; /* data to be passed up to app */
@@ -131,14 +256,47 @@ void _mysock_enqueue_buffer(mysock_context_t *ctx,
                             const void       *packet,
                             size_t            packet_len);
 
+void _mysock_enqueue_ref(mysock_context_t *ctx,
+                         packet_queue_t   *pq,
+                         packet_buf_t     *buf,
+                         const char       *data,
+                         size_t            data_len);
+
 size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
                               packet_queue_t   *pq,
                               void             *dst,
                               size_t            max_len,
                               bool_t            remove_partial);
 
+size_t _mysock_dequeue_line(mysock_context_t *ctx,
+                            packet_queue_t   *pq,
+                            void             *dst,
+                            size_t            max_len);
+
+size_t _mysock_peek_buffer(mysock_context_t *ctx,
+                           packet_queue_t   *pq,
+                           void             *dst,
+                           size_t            max_len);
+
+size_t _mysock_dequeue_ref(mysock_context_t *ctx,
+                           packet_queue_t   *pq,
+                           packet_buf_t    **buf,
+                           char            **data);
+
+bool_t _mysock_flush_queue(mysock_context_t *ctx,
+                           packet_queue_t   *pq,
+                           bool_t            wait);
+
+void _mysock_close_queue(mysock_context_t *ctx, packet_queue_t *pq);
+
 int _mysock_bind_ephemeral(mysock_context_t *ctx);
 
+int _mysock_get_option(mysock_context_t *ctx, int optname, int *value);
+
+void _mysock_push_app_data(mysock_context_t *ctx);
+
+void _mysock_app_data_read(mysock_context_t *ctx);
+
 pthread_t _mysock_create_thread(void *(*start)(void *args), void *args,                                         bool_t create_detached);
 
 #endif  /* __MYSOCK_INTERNAL_H__ */
@@ -10,24 +10,144 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include "mysock_impl.h"
 #include "network.h"
 #include "network_io.h"
-#include "transport.h"  /* for dprintf() */
+#include "tcp_sum.h"
+#include "transport.h"  /* for dprintf(), TCP_DATA_START(), TCPOPT_* */
 
 
+/* a lossy network, for testing, set up from the environment:
+ *
+ *   STCP_DROP      percentage of outgoing segments carrying data that
+ *                  are dropped
+ *   STCP_REORDER   percentage of outgoing segments, bar SYNs, held back
+ *                  to go out after the next one
+ *   STCP_MTU       largest packet sent, STCP header included
+ *   STCP_NOSACK    if non-zero, SACK-permitted options are stripped from
+ *                  SYNs, as a middlebox might, so recovery has to do
+ *                  without SACK blocks
+ *
+ * all of them are off unless set.  the handshake is otherwise left alone,
+ * so that what's tested is the recovery of the data, and that of the
+ * window from acks that arrive out of order.
+ */
+static struct
+{
+    int    drop_pct;
+    int    reorder_pct;
+    size_t mtu;
+    bool_t nosack;
+} network_sim;
+
+static pthread_once_t network_sim_once = PTHREAD_ONCE_INIT;
+
+static int _network_sim_pct(const char *name)
+{
+    const char *env = getenv(name);
+    int pct = (env && *env) ? atoi(env) : 0;
+
+    return MAX(0, MIN(pct, 100));
+}
+
+static void _network_sim_start(void)
+{
+    const char *env = getenv("STCP_MTU");
+
+    network_sim.drop_pct = _network_sim_pct("STCP_DROP");
+    network_sim.reorder_pct = _network_sim_pct("STCP_REORDER");
+    if (env && atoi(env) > 0)
+        network_sim.mtu = (size_t) atoi(env);
+    env = getenv("STCP_NOSACK");
+    network_sim.nosack = env && atoi(env) != 0;
+}
+
+/* overwrite any SACK-permitted option in the SYN at packet with no-ops,
+ * and checksum the packet again
+ */
+static void _network_sim_strip_sack(mysock_context_t *sock_ctx,
+                                    char *packet, size_t len)
+{
+    size_t i = sizeof(struct tcphdr), end = TCP_DATA_START(packet);
 
+    assert(end <= len);
+    while (i < end && packet[i] != TCPOPT_EOL)
+    {
+        if (packet[i] == TCPOPT_NOP)
+        {
+            ++i;
+            continue;
+        }
+        if (i + 1 >= end || (unsigned char) packet[i + 1] < 2)
+            break;  /* malformed; leave the rest be */
+
+        if (packet[i] == TCPOPT_SACK_PERMITTED)
+            memset(packet + i, TCPOPT_NOP, TCPOLEN_SACK_PERMITTED);
+        i += (unsigned char) packet[i + 1];
+    }
+
+    ((struct tcphdr *) packet)->th_sum = 0;
+    _mysock_set_checksum(sock_ctx, packet, len);
+}
 
 /* helper function for stcp_network_send(); */
 int _network_send(mysocket_t sd, const void *buf, size_t len)
 {
     mysock_context_t *sock_ctx = _mysock_get_context(sd);
     network_context_t *ctx;
+    int rc;
 
     assert(sock_ctx && buf);
     ctx = &sock_ctx->network_state;
 
-    return _network_send_packet(ctx, buf, len);
+    PTHREAD_CALL(pthread_once(&network_sim_once, _network_sim_start));
+    if (network_sim.nosack && (((const STCPHeader *) buf)->th_flags & TH_SYN))
+    {
+        char packet[MAX_PACKET_LEN];
+
+        assert(len <= sizeof(packet));
+        memcpy(packet, buf, len);
+        _network_sim_strip_sack(sock_ctx, packet, len);
+        return _network_send_packet(ctx, packet, len);
+    }
+    if (network_sim.drop_pct > 0 && len > TCP_DATA_START(buf) &&
+        (int) (rand_r(&ctx->random_seed) % 100) < network_sim.drop_pct)
+    {
+        return len;
+    }
+    if (network_sim.reorder_pct > 0 && !ctx->copied &&
+        !(((const STCPHeader *) buf)->th_flags & TH_SYN) &&
+        (int) (rand_r(&ctx->random_seed) % 100) < network_sim.reorder_pct)
+    {
+        assert(len <= sizeof(ctx->copy_buffer));
+        memcpy(ctx->copy_buffer, buf, len);
+        ctx->copy_buf_len = len;
+        ctx->copied = TRUE;
+        return len;
+    }
+
+    rc = _network_send_packet(ctx, buf, len);
+    if (ctx->copied)
+    {
+        /* the packet held back goes out behind this one */
+        ctx->copied = FALSE;
+        (void) _network_send_packet(ctx, ctx->copy_buffer, ctx->copy_buf_len);
+    }
+    return rc;
+}
+
+/* the largest packet _network_send() takes, STCP_MTU permitting */
+size_t _network_max_send(mysocket_t sd)
+{
+    mysock_context_t *sock_ctx = _mysock_get_context(sd);
+    size_t len;
+
+    assert(sock_ctx);
+    len = _network_max_packet_len(&sock_ctx->network_state);
+
+    PTHREAD_CALL(pthread_once(&network_sim_once, _network_sim_start));
+    return network_sim.mtu ? MIN(len, network_sim.mtu) : len;
 }
 
 /* helper function for stcp_network_recv() */
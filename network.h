@@ -9,6 +9,7 @@
 
 int _network_send(mysocket_t sd, const void *buf, size_t len);
 int _network_recv(mysocket_t sd, void *dst, size_t max_len);
+size_t _network_max_send(mysocket_t sd);
 
 #endif  /* __NETWORK_H__ */
 
@@ -15,17 +15,27 @@
  * onerous a restriction, as this interface is used only in the TCP
  * checksum calculation, which satisfies the aforementioned
  * requirements).
+ *
+ * the lookup goes through the resolver, so it's done once per connection
+ * rather than once per checksum.
  */
 
 uint32_t _network_get_local_addr(network_context_t *ctx)
 {
+    uint32_t addr;
+
     assert(ctx);
 
     assert(ctx->peer_addr_valid);
     assert(ctx->peer_addr_len > 0);
     assert(ctx->peer_addr.sa_family == AF_INET);
 
-    return _network_get_interface_ip(
-        ((struct sockaddr_in *) &ctx->peer_addr)->sin_addr.s_addr);
+    if ((addr = ctx->peer_facing_addr.load(std::memory_order_relaxed)) == 0)
+    {
+        addr = _network_get_interface_ip(
+            ((struct sockaddr_in *) &ctx->peer_addr)->sin_addr.s_addr);
+        ctx->peer_facing_addr.store(addr, std::memory_order_relaxed);
+    }
+    return addr;
 }
 
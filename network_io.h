@@ -9,9 +9,11 @@
 #ifdef LINUX
 #include <stdint.h>
 #endif
+#include <atomic>
 #include "mysock.h"
 
 #define MAX_IP_PAYLOAD_LEN 1500
+#define MAX_PACKET_LEN 0xffff   /* largest packet any backend carries */
 
 
 struct mysock_context;
@@ -27,13 +29,18 @@ typedef struct
     socklen_t       peer_addr_len;
     bool_t          peer_addr_valid;
 
+    /* our address toward the peer, once looked up; 0 until then.  both
+     * the transport and the receive thread checksum with it
+     */
+    std::atomic<uint32_t> peer_facing_addr;
+
     /* additional (opaque) data used by underlying I/O implementation */
     void *impl_data;
 
     /* packet reordering/duplication simulation */
     unsigned int random_seed;
     bool_t       copied;
-    char         copy_buffer[MAX_IP_PAYLOAD_LEN];
+    char         copy_buffer[MAX_PACKET_LEN];
     size_t       copy_buf_len;
 } network_context_t;
 
@@ -61,6 +68,11 @@ uint32_t _network_get_local_addr(network_context_t *ctx);
  */
 uint32_t _network_get_interface_ip(uint32_t peer_addr);
 
+/* largest STCP packet, header and all, the backend can carry; at most
+ * MAX_PACKET_LEN.
+ */
+size_t _network_max_packet_len(network_context_t *ctx);
+
 /* send an STCP packet to our peer */
 ssize_t _network_send_packet(network_context_t *ctx,
                              const void *src, size_t len);
@@ -170,7 +170,7 @@ int _network_init_socket(mysock_context_t  *sock_ctx,
     assert(sock_ctx && net_ctx);
     assert(ctx_len >= sizeof(network_context_socket_t));
 
-    memset(net_ctx, 0, sizeof(*net_ctx));
+    memset((void *) net_ctx, 0, sizeof(*net_ctx));
     net_ctx->random_seed = 0x632a;
 
     if (!(net_ctx->impl_data = _network_alloc_context_socket(type, ctx_len)))
@@ -207,7 +207,8 @@ int _network_bind_socket(network_context_t *ctx,
  */
 static void *network_recv_thread_func(void *arg_ptr)
 {
-    char packet_buf[MAX_IP_PAYLOAD_LEN];
+    packet_buf_t *landing = NULL;
+    size_t landing_len;
     mysock_context_t *ctx;
     network_context_socket_t *net_ctx;
 
@@ -218,6 +219,12 @@ static void *network_recv_thread_func(void *arg_ptr)
     net_ctx = (network_context_socket_t *) ctx->network_state.impl_data;
     assert(net_ctx);
 
+    /* packets are read straight into a buffer from the receive queue's
+     * pool, which then goes up to STCP as it is
+     */
+    landing_len = MIN(_network_max_packet_len(&ctx->network_state),
+                      MAX_PACKET_LEN);
+
     for (;;)
     {
         ssize_t bytes_read;
@@ -260,9 +267,13 @@ static void *network_recv_thread_func(void *arg_ptr)
         /* block, waiting for network input.  (the system call will be
          * interrupted by the transport layer thread if we're to exit).
          */
+        if (!landing)
+            landing = _packet_buf_alloc(&ctx->network_recv_queue.pool,
+                                        landing_len);
+
         if ((bytes_read = _network_recv_packet(&ctx->network_state,
-                                               packet_buf,
-                                               sizeof(packet_buf))) <= 0)
+                                               landing->data,
+                                               landing_len)) <= 0)
         {
             DEBUG_LOG(("_network_recv_packet interrupted, errno=%d\n", errno));
             //signal an error to the transport layer
@@ -270,25 +281,37 @@ static void *network_recv_thread_func(void *arg_ptr)
             break;
         }
 
-        assert(bytes_read <= (int)sizeof(packet_buf));
+        assert(bytes_read <= (int)landing_len);
         if (ctx->listening)
         {
             /* if the socket was accepting new connections, incoming
              * packets need to be demultiplexed and dispatched to the
              * appropriate mysocket context.
              */
-            _mysock_enqueue_connection(ctx, packet_buf, bytes_read,
+            _mysock_enqueue_connection(ctx, landing->data, bytes_read,
                                        &ctx->network_state.peer_addr,
                                        ctx->network_state.peer_addr_len, NULL);
         }
+        else if (2 * _packet_buf_size_for(bytes_read) <= landing->size)
+        {
+            /* a small packet (an ack, say) would tie up a big buffer while
+             * it waits; copy it into a buffer its size, and keep this one
+             */
+            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue,
+                                   landing->data, bytes_read);
+        }
         else
         {
             /* enqueue the packet directly for this context */
-            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue,
-                                   packet_buf, bytes_read);
+            _mysock_enqueue_ref(ctx, &ctx->network_recv_queue, landing,
+                                landing->data, bytes_read);
+            _packet_buf_release(landing);
+            landing = NULL;
         }
     }
 
+    if (landing)
+        _packet_buf_release(landing);
     return NULL;
 }
 
@@ -5,6 +5,9 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <alloca.h>
@@ -14,11 +17,13 @@
 
 
 #define MAX_NUM_PENDING_CONNECTIONS 10
+#define MAX_TCP_FRAME_LEN 0xffff    /* the length prefix is 16 bits */
 
 typedef ssize_t (*io_func_t)(socket_t sd, void *buf, size_t count);
 
 static int _tcp_io(socket_t, void *, size_t, io_func_t);
 static int _tcp_connect(network_context_t *ctx);
+static void _tcp_set_nodelay(socket_t tcp_sd);
 
 
 /* a few words about using TCP to emulate the underlying datagram
@@ -33,6 +38,10 @@ static int _tcp_connect(network_context_t *ctx);
  *   - the passive side dispatches the SYN packet to the right STCP
  *     context, and updates the new context's TCP socket to be that of the
  *     newly accepted (real TCP) connection.
+ *   - each packet goes out as a 16-bit length and the packet itself, in one
+ *     writev() with Nagle turned off, so STCP's own timing is what the peer
+ *     sees.  packets can be as long as the length allows, not just an IP
+ *     payload.
  */
 
 
@@ -131,15 +140,24 @@ void _network_update_passive_state(network_context_t *new_ctx,
 }
 
 
+size_t _network_max_packet_len(network_context_t *ctx)
+{
+    return MAX_TCP_FRAME_LEN;
+}
+
 /* send the given packet to the peer */
 ssize_t _network_send_packet(network_context_t *ctx,
                              const void *src, size_t len)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
     uint16_t packet_len;    /* network byte order */
+    struct iovec frame[2];
+    size_t frame_len = sizeof(packet_len) + len;
+    ssize_t rc;
 
     assert(ctx && src);
     assert(ctx->peer_addr_len > 0);
+    assert(len <= MAX_TCP_FRAME_LEN);
 
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
     assert(tcp_io_ctx);
@@ -151,11 +169,30 @@ ssize_t _network_send_packet(network_context_t *ctx,
         return -1;
 
     packet_len = htons(len);
-    if (_tcp_io(GET_SOCKET(ctx), &packet_len, sizeof(packet_len),
-                (io_func_t) write) < 0 ||
-        _tcp_io(GET_SOCKET(ctx), (void *) src, len, (io_func_t) write) < 0)
+    frame[0].iov_base = &packet_len;
+    frame[0].iov_len = sizeof(packet_len);
+    frame[1].iov_base = (void *) src;
+    frame[1].iov_len = len;
+
+    if ((rc = writev(GET_SOCKET(ctx), frame, 2)) < 0)
         return -1;
 
+    if ((size_t) rc < frame_len)
+    {
+        /* short write; finish off the frame the slow way */
+        size_t sent = (size_t) rc;
+
+        if (sent < sizeof(packet_len) &&
+            _tcp_io(GET_SOCKET(ctx), (char *) &packet_len + sent,
+                    sizeof(packet_len) - sent, (io_func_t) write) < 0)
+            return -1;
+
+        sent = (sent > sizeof(packet_len)) ? sent - sizeof(packet_len) : 0;
+        if (_tcp_io(GET_SOCKET(ctx), (char *) src + sent, len - sent,
+                    (io_func_t) write) < 0)
+            return -1;
+    }
+
     return len;
 }
 
@@ -201,6 +238,7 @@ ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
          * socket updated to be 'new_socket'
          */
         assert(tcp_io_ctx->new_socket == -1);
+        _tcp_set_nodelay(tmp_sd);
         tcp_io_ctx->new_socket = tmp_sd;
         io_socket = tmp_sd;
     }
@@ -291,6 +329,7 @@ static int _tcp_connect(network_context_t *ctx)
             return -1;
         }
 
+        _tcp_set_nodelay(GET_SOCKET(ctx));
         tcp_io_ctx->connected = TRUE;
     }
     PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
@@ -298,3 +337,17 @@ static int _tcp_connect(network_context_t *ctx)
     return 0;
 }
 
+/* packets are framed as they're sent, so there's nothing to be gained by
+ * the real TCP holding small ones back.
+ */
+static void _tcp_set_nodelay(socket_t tcp_sd)
+{
+    int on = 1;
+
+    if (setsockopt(tcp_sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+    {
+        DEBUG_LOG(("couldn't set TCP_NODELAY on %d (errno=%d)\n",
+                   (int) tcp_sd, errno));
+    }
+}
+
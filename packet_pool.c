@@ -0,0 +1,211 @@
+/*
+ * packet_pool.c
+ *
+ * size-class slab pool behind the packet buffers.  each buffer is its
+ * header followed by its data, both carved from the same slab.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include "packet_pool.h"
+
+#define BUF_ALIGN(len)  (((len) + 15) & ~(size_t) 15)
+
+/* room for a buffer's header, keeping the data after it aligned */
+#define BUF_HEADER_LEN  BUF_ALIGN(sizeof(packet_buf_t))
+
+/* ack-sized, small-write-sized, a whole datagram, and two sizes of the
+ * larger segments the TCP backend carries.  the bigger the buffers, the
+ * fewer are carved from each slab.
+ */
+static const struct
+{
+    size_t len;
+    unsigned int slab_bufs;
+} pool_class_info[POOL_CLASSES] =
+{
+    { 128,                32 },
+    { 512,                16 },
+    { MAX_IP_PAYLOAD_LEN, 8  },
+    { 16384,              2  },
+    { MAX_PACKET_LEN,     1  }
+};
+
+
+static int _packet_pool_class(size_t len)
+{
+    int k;
+
+    for (k = 0; k < POOL_CLASSES && len > pool_class_info[k].len; ++k)
+        ;
+    return k < POOL_CLASSES ? k : POOL_HEAP;
+}
+
+size_t _packet_buf_size_for(size_t len)
+{
+    int k = _packet_pool_class(len);
+    return k == POOL_HEAP ? len : pool_class_info[k].len;
+}
+
+static void _packet_pool_count(std::atomic<uint64_t> *counter)
+{
+    counter->store(counter->load(std::memory_order_relaxed) + 1,
+                   std::memory_order_relaxed);
+}
+
+static packet_buf_t *_packet_buf_init(char *mem, packet_pool_t *pool,
+                                      int cls, size_t size)
+{
+    packet_buf_t *buf = (packet_buf_t *) mem;
+
+    buf->refs.store(1, std::memory_order_relaxed);
+    buf->next = NULL;
+    buf->pool = pool;
+    buf->cls = cls;
+    buf->size = size;
+    buf->data = mem + BUF_HEADER_LEN;
+    return buf;
+}
+
+/* carve a new slab for class k, of at least n buffers, a slab's worth,
+ * and as many again as the class has made so far, so a class that keeps
+ * needing more goes to the heap only every time its peak doubles
+ */
+static void _packet_pool_grow(pool_class_t *pc, int k, unsigned int n)
+{
+    size_t unit = BUF_HEADER_LEN + BUF_ALIGN(pool_class_info[k].len);
+
+    assert(pc->carve_left == 0 && pc->carved < POOL_CLASS_BUFS);
+    if (n < pool_class_info[k].slab_bufs)
+        n = pool_class_info[k].slab_bufs;
+    if (n < pc->carved)
+        n = pc->carved;
+    if (n > POOL_CLASS_BUFS - pc->carved)
+        n = POOL_CLASS_BUFS - pc->carved;
+
+    pc->carve = (char *) malloc(n * unit);
+    assert(pc->carve);
+    pc->slabs[pc->num_slabs++] = pc->carve;
+    pc->carve_left = n;
+}
+
+packet_buf_t *_packet_buf_alloc(packet_pool_t *pool, size_t len)
+{
+    pool_class_t *pc;
+    packet_buf_t *buf;
+    size_t unit;
+    char *mem;
+    int k;
+
+    assert(pool);
+
+    if ((k = _packet_pool_class(len)) == POOL_HEAP)
+        goto heap;
+    pc = &pool->classes[k];
+
+    /* reuse whatever has been let go of, taking the lot at once */
+    if (!pc->free_list)
+        pc->free_list = pc->returned.exchange(NULL, std::memory_order_acquire);
+    if ((buf = pc->free_list) != NULL)
+    {
+        pc->free_list = buf->next;
+        buf->next = NULL;
+        buf->refs.store(1, std::memory_order_relaxed);
+        _packet_pool_count(&pool->hits);
+        return buf;
+    }
+
+    if (pc->carved == POOL_CLASS_BUFS)
+        goto heap;  /* the class has all it's allowed out */
+
+    /* nothing back yet; make a new buffer, a slab at a time */
+    unit = BUF_HEADER_LEN + BUF_ALIGN(pool_class_info[k].len);
+    if (pc->carve_left == 0)
+    {
+        _packet_pool_grow(pc, k, 0);
+        _packet_pool_count(&pool->misses);
+    }
+    else
+    {
+        _packet_pool_count(&pool->hits);
+    }
+    mem = pc->carve;
+    pc->carve += unit;
+    --pc->carve_left;
+    ++pc->carved;
+    return _packet_buf_init(mem, pool, k, pool_class_info[k].len);
+
+heap:
+    mem = (char *) malloc(BUF_HEADER_LEN + len);
+    assert(mem);
+    _packet_pool_count(&pool->misses);
+    return _packet_buf_init(mem, pool, POOL_HEAP, len);
+}
+
+void _packet_pool_reserve(packet_pool_t *pool, size_t len, unsigned int count)
+{
+    pool_class_t *pc;
+    int k;
+
+    assert(pool);
+    if ((k = _packet_pool_class(len)) == POOL_HEAP)
+        return;
+
+    pc = &pool->classes[k];
+    if (pc->carved == 0 && pc->carve_left == 0)
+        _packet_pool_grow(pc, k, count);
+}
+
+void _packet_buf_release(packet_buf_t *buf)
+{
+    pool_class_t *pc;
+    packet_buf_t *head;
+
+    assert(buf && buf->refs.load(std::memory_order_relaxed) > 0);
+    if (buf->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    if (buf->cls == POOL_HEAP)
+    {
+        free(buf);
+        return;
+    }
+
+    /* push it on the class's returned stack.  the producer only ever takes
+     * the whole stack, so there's no ABA to worry about.
+     */
+    pc = &buf->pool->classes[buf->cls];
+    head = pc->returned.load(std::memory_order_relaxed);
+    do
+    {
+        buf->next = head;
+    } while (!pc->returned.compare_exchange_weak(head, buf,
+                                                 std::memory_order_release,
+                                                 std::memory_order_relaxed));
+}
+
+void _packet_pool_destroy(packet_pool_t *pool)
+{
+    unsigned int i;
+    int k;
+
+    assert(pool);
+    for (k = 0; k < POOL_CLASSES; ++k)
+    {
+        pool_class_t *pc = &pool->classes[k];
+
+        for (i = 0; i < pc->num_slabs; ++i)
+            free(pc->slabs[i]);
+
+        /* back to the empty pool a zeroed one is */
+        pc->free_list = NULL;
+        pc->carve = NULL;
+        pc->carve_left = 0;
+        pc->carved = 0;
+        pc->num_slabs = 0;
+        pc->returned.store(NULL, std::memory_order_relaxed);
+    }
+    pool->hits.store(0, std::memory_order_relaxed);
+    pool->misses.store(0, std::memory_order_relaxed);
+}
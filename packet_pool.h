@@ -0,0 +1,107 @@
+/* packet_pool.h--refcounted packet buffers, from a slab pool.
+ *
+ * a packet_buf_t is filled once, by whoever receives or copies the data,
+ * and then passed between layers by reference:  each queue slot or layer
+ * holding on to part of it holds a reference, and the last to let go
+ * returns it to the pool it came from.
+ *
+ * every packet queue has a pool of its own, which only the queue's
+ * producer allocates from.  buffers come in a few fixed size classes, up
+ * to MAX_IP_PAYLOAD_LEN plus two for the bigger segments the TCP backend
+ * carries, carved a slab at a time, each slab doubling what its class
+ * has.  a buffer can be let go of from any thread, so freed ones go back
+ * on a lock-free stack that the producer takes whole when it runs out;
+ * neither side takes a lock or goes near malloc() once the pool has
+ * warmed up.  anything larger than the biggest
+ * class, or beyond what a class will hold, comes from the heap instead.
+ */
+
+#ifndef __PACKET_POOL_H__
+#define __PACKET_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include "network_io.h"     /* MAX_IP_PAYLOAD_LEN, MAX_PACKET_LEN */
+
+#define CACHE_LINE_LEN      64
+
+#define POOL_CLASSES        5
+#define POOL_CLASS_BUFS     1024    /* most buffers a class hands out; a
+                                     * full queue's worth, so a producer
+                                     * that fills one doesn't go to the heap
+                                     */
+#define POOL_HEAP           (-1)    /* class of a buffer from the heap */
+
+struct packet_pool;
+
+typedef struct packet_buf
+{
+    std::atomic<int>    refs;
+    struct packet_buf  *next;       /* while on a free list */
+    struct packet_pool *pool;       /* where it goes back to */
+    int                 cls;
+    size_t              size;       /* room at data */
+    char               *data;
+} packet_buf_t;
+
+typedef struct
+{
+    /* producer's side */
+    alignas(CACHE_LINE_LEN) packet_buf_t *free_list;
+    char       *carve;              /* rest of the newest slab */
+    unsigned int carve_left;
+    unsigned int carved;            /* buffers made, at most POOL_CLASS_BUFS */
+    char       *slabs[POOL_CLASS_BUFS];
+    unsigned int num_slabs;
+
+    /* buffers let go of since the producer last looked, from any thread */
+    alignas(CACHE_LINE_LEN) std::atomic<packet_buf_t *> returned;
+} pool_class_t;
+
+typedef struct packet_pool
+{
+    pool_class_t classes[POOL_CLASSES];
+
+    /* allocations served without / with a call to malloc() */
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+} packet_pool_t;
+
+/* the counters, as two unsigned long longs for a printf-style "%llu/%llu" */
+#define POOL_COUNTERS(pool) \
+    (unsigned long long) (pool)->hits.load(std::memory_order_relaxed), \
+    (unsigned long long) (pool)->misses.load(std::memory_order_relaxed)
+
+/* a zeroed packet_pool_t is an empty pool, ready to use.  returns a buffer
+ * with room for at least len bytes, holding one reference.  the pool's
+ * producer only.
+ */
+packet_buf_t *_packet_buf_alloc(packet_pool_t *pool, size_t len);
+
+/* the room a buffer for len bytes would have; a packet that leaves more
+ * than half of a buffer empty is worth copying into a smaller one
+ */
+size_t _packet_buf_size_for(size_t len);
+
+/* carve count buffers (a slab's worth at least) for the class len falls
+ * in now, if it has none yet, rather than when they're first wanted,
+ * at a time going to the heap would stand out.  the pool's producer, or
+ * whoever sets it up before there is one.
+ */
+void _packet_pool_reserve(packet_pool_t *pool, size_t len, unsigned int count);
+
+static inline void _packet_buf_hold(packet_buf_t *buf)
+{
+    buf->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* drop a reference, from any thread; the last one returns the buffer */
+void _packet_buf_release(packet_buf_t *buf);
+
+/* release the pool's slabs, leaving it empty, its counters included.
+ * nothing may still hold one of its buffers.
+ */
+void _packet_pool_destroy(packet_pool_t *pool);
+
+#endif  /* __PACKET_POOL_H__ */
@@ -26,10 +26,10 @@
 
 
 
-static char usage[] = "usage: %s \n";
+static char usage[] = "usage: %s [-c reno|cubic|bbr]\n";
 
 static void do_connection(mysocket_t bindsd);
-static int get_nvt_line(int sd, char *);
+static int get_nvt_line(int sd, char *, size_t);
 static int process_line(int sd, char *);
 static int local_name(mysocket_t sd, char *name);
 
@@ -40,14 +40,19 @@ main(int argc, char *argv[])
     struct sockaddr_in sin;
     mysocket_t bindsd;
     int len, opt, errflg = 0;
+    int congestion_opt = MYCC_RENO;
     char localname[256];
 
 
     /* Parse the command line */
-    while ((opt = getopt(argc, argv, "")) != EOF)
+    while ((opt = getopt(argc, argv, "c:")) != EOF)
     {
         switch (opt)
         {
+        case 'c':
+            if ((congestion_opt = mycongestion_by_name(optarg)) < 0)
+                ++errflg;
+            break;
         case '?':
             ++errflg;
             break;
@@ -67,6 +72,13 @@ main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    /* accepted connections inherit this from the listening socket */
+    if (mysetsockopt(bindsd, MYSO_CONGESTION, congestion_opt) < 0)
+    {
+        perror("mysetsockopt");
+        exit(EXIT_FAILURE);
+    }
+
     memset(&sin, 0, sizeof(sin));
     sin.sin_family = AF_INET;
     sin.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -129,7 +141,7 @@ static void do_connection(mysocket_t sd)
 
     for (;;)
     {
-        rc = get_nvt_line(sd, line);
+        rc = get_nvt_line(sd, line, sizeof(line));
         if (rc < 0 || !*line)
             goto done;
         fprintf(stderr, "client: %s\n", line);
@@ -159,38 +171,30 @@ done:
  *  -1 on failure
  */
 static int
-get_nvt_line(int sd, char *line)
+get_nvt_line(int sd, char *line, size_t size)
 {
-    char last_char;
-    char this_char;
     int len;
 
-    last_char = '\0';
-    for (;;)
-    {
-        len = myread(sd, &this_char, sizeof(this_char));
-        if (len < 0)
-            return -1;
-
-        if (len == 0)
-        {
-            /* Connection ended before line terminator (or empty string) */
-            *line = '\0';
-            return 0;
-        }
-    /** fprintf(stderr, "read character %c\n", this_char); **/
-        if (last_char == '\r' && this_char == '\n')
-        {
-            /* Reached the end of line. Already wrote \r into string, overwrite
-             * it with a NUL */
-            line[-1] = '\0';
-            return 0;
-        }
+    /* leave room for the NUL */
+    if ((len = myreadline(sd, line, size - 1)) < 0)
+        return -1;
 
-        *line++ = this_char;
-        last_char = this_char;
+    if (len >= 2 && line[len - 2] == '\r' && line[len - 1] == '\n')
+    {
+        /* Reached the end of line; overwrite the \r with a NUL */
+        len -= 2;
+    }
+    else if (len == (int) size - 1)
+    {
+        /* no terminator in the room we have */
+        errno = EMSGSIZE;
+        return -1;
     }
-    return -1;
+    /* otherwise the connection ended before the line terminator (or
+     * empty string) */
+
+    line[len] = '\0';
+    return 0;
 }
 
 /**********************************************************************/
@@ -208,7 +212,7 @@ static int
 process_line(int sd, char *line)
 {
     char resp[5000];
-    int fd = -1, length;
+    int fd = -1, length, rc = -1, saved_errno;
 
     if (!*line || access(line, R_OK) < 0)
     {
@@ -227,16 +231,22 @@ process_line(int sd, char *line)
         }
     }
   /** fprintf(stderr, "sending to client: %s of length %d bytes\n", resp, strlen(resp)); **/
+    /* cork the socket so the response line shares a segment with the start
+     * of the file, rather than going out on its own.  every way out of here
+     * uncorks, so nothing (an error reply least of all) sits corked until
+     * the connection closes.
+     */
+    mysetsockopt(sd, MYSO_CORK, 1);
+
     /* Return the response to the client */
     if (mywrite(sd, resp, strlen(resp)) < 0)
-    {
-        if (fd != -1)
-            close(fd);
-        return -1;
-    }
+        goto done;
 
     if (fd == -1)
-        return 0;
+    {
+        rc = 0;
+        goto done;
+    }
 
     for (;;)
     {
@@ -247,21 +257,23 @@ process_line(int sd, char *line)
         if (length == -1)
         {
             perror("read");
-            close(fd);
-            return -1;
+            goto done;
         }
 
         /* fwrite(resp, length, 1, stdout); */
 
         if (mywrite(sd, resp, length) < 0)
-        {
-            close(fd);
-            return -1;
-        }
+            goto done;
     }
+    rc = 0;
 
-    close(fd);
-    return 0;
+done:
+    saved_errno = errno;    /* for the caller's perror() */
+    if (fd != -1)
+        close(fd);
+    mysetsockopt(sd, MYSO_CORK, 0);
+    errno = saved_errno;
+    return rc;
 }
 
 /* local_name()
@@ -2,6 +2,7 @@
 
 #include <pthread.h>
 #include <stdarg.h>
+#include <time.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
@@ -48,11 +49,73 @@ void stcp_unblock_application(mysocket_t sd)
 }
 
 
+/* the events in flags that are ready for STCP; called with data_ready_lock
+ * held
+ */
+static unsigned int _stcp_ready_events(mysock_context_t *ctx,
+                                       unsigned int      flags)
+{
+    unsigned int rc = 0;
+    size_t low_water;
+
+    /* a cork takes effect straight away, even if STCP hasn't seen it */
+    low_water = ctx->app_low_water;
+    if (ctx->options.cork && low_water == 0)
+        low_water = ctx->app_mss;
+
+    /* a full queue is reported whatever the low water mark, as the app
+     * can't add the rest until STCP takes some
+     */
+    if ((flags & APP_DATA) && !_mysock_queue_empty(&ctx->app_recv_queue) &&
+        (_mysock_queue_bytes(&ctx->app_recv_queue) >= low_water ||
+         _mysock_queue_full(&ctx->app_recv_queue) ||
+         ctx->app_push || ctx->close_requested))
+        rc |= APP_DATA;
+
+    if ((flags & NETWORK_DATA) &&
+        !_mysock_queue_empty(&ctx->network_recv_queue))
+        rc |= NETWORK_DATA;
+
+    if ((flags & APP_DRAINED) && ctx->app_drained)
+    {
+        ctx->app_drained = FALSE;
+        rc |= APP_DRAINED;
+    }
+
+    if (/*(flags & APP_CLOSE_REQUESTED) &&*/
+        ctx->close_requested && _mysock_queue_empty(&ctx->app_recv_queue))
+    {
+        /* we should only wake up on this event once.  also, we don't
+         * pass the close event down to STCP until we've already passed
+         * it all outstanding data from the app.
+         */
+        ctx->close_requested = FALSE;
+        rc |= APP_CLOSE_REQUESTED;
+    }
+
+    return rc;
+}
+
+/* TRUE if abstime is already behind us, so a wait would only poll */
+static bool_t _stcp_time_passed(const struct timespec *abstime)
+{
+    struct timespec now;
+
+    if (abstime->tv_sec == 0 && abstime->tv_nsec == 0)
+        return TRUE;    /* the usual way of asking, and no clock needed */
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return abstime->tv_sec < now.tv_sec ||
+           (abstime->tv_sec == now.tv_sec && abstime->tv_nsec <= now.tv_nsec);
+}
+
 /* called by the transport layer to wait for new data, either from the network
  * or from the application, or for the application to request that the
  * mysocket be closed, depending on the value of flags.  abstime is the
- * absolute time at which the function should quit waiting; if NULL, it blocks
- * indefinitely until data arrives.
+ * absolute time on CLOCK_MONOTONIC at which the function should quit waiting
+ * (the wake channels time out on that clock); if NULL, it blocks
+ * indefinitely until data arrives.  an abstime that has already passed
+ * just polls, without going near the wake channel.
  *
  * sd is the mysocket descriptor for the connection of interest.
  *
@@ -66,63 +129,58 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
     unsigned int rc = 0;
     mysock_context_t *ctx = _mysock_get_context(sd);
 
-    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    if (abstime && _stcp_time_passed(abstime))
+    {
+        if (ctx->app_send_queue.spill_len > 0)
+            (void) _mysock_flush_queue(ctx, &ctx->app_send_queue, FALSE);
+
+        /* a caller only after queued data has nothing to hear of if
+         * neither queue holds any; a close request stays put for its next
+         * wait, so there's no need to take the lock to look for one
+         */
+        if (!(flags & ~(NETWORK_DATA | APP_DATA)) &&
+            !((flags & NETWORK_DATA) &&
+              !_mysock_queue_empty(&ctx->network_recv_queue)) &&
+            !((flags & APP_DATA) &&
+              !_mysock_queue_empty(&ctx->app_recv_queue)))
+            return 0;
+
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        rc = _stcp_ready_events(ctx, flags);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+        return rc;
+    }
+
+    /* we're the consumer of both queues.  say what we're waiting for
+     * before each look, so only the producers (and requests) we care
+     * about wake us, and only while we're asleep; a close request is
+     * always of interest.  so is room for anything we've had to spill on
+     * the way up to the app, which goes up while we wait.
+     */
     for (;;)
     {
-        if ((flags & APP_DATA) && (ctx->app_recv_queue.head != NULL))
-            rc |= APP_DATA;
-
-        if ((flags & NETWORK_DATA) && (ctx->network_recv_queue.head != NULL))
-            rc |= NETWORK_DATA;
-
-        if (/*(flags & APP_CLOSE_REQUESTED) &&*/
-            ctx->close_requested && (ctx->app_recv_queue.head == NULL))
-        {
-            /* we should only wake up on this event once.  also, we don't
-             * pass the close event down to STCP until we've already passed
-             * it all outstanding data from the app.
-             */
-            ctx->close_requested = FALSE;
-            rc |= APP_CLOSE_REQUESTED;
-        }
+        unsigned int events = flags | APP_CLOSE_REQUESTED;
+        uint32_t seq;
+
+        if (ctx->app_send_queue.spill_len > 0)
+            events |= QUEUE_ROOM;
+        seq = _wake_channel_prepare(&ctx->transport_ch, events);
+        if (events & QUEUE_ROOM)
+            (void) _mysock_flush_queue(ctx, &ctx->app_send_queue, FALSE);
+
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        rc = _stcp_ready_events(ctx, flags);
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
 
         if (rc)
             break;
 
-        if (abstime)
-        {
-            /* wait with timeout */
-            switch (pthread_cond_timedwait(&ctx->data_ready_cond,
-                                           &ctx->data_ready_lock,
-                                           abstime))
-            {
-            case 0: /* some data might be available */
-            case EINTR:
-                break;
-
-            case ETIMEDOUT: /* no data arrived in the specified time */
-                goto done;
-
-            case EINVAL:
-                assert(0);
-                break;
-
-            default:
-                assert(0);
-                break;
-            }
-        }
-        else
-        {
-            /* block indefinitely */
-            PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
-                                           &ctx->data_ready_lock));
-        }
+        /* block until woken, or with timeout if abstime is given */
+        if (!_wake_channel_sleep(&ctx->transport_ch, seq, abstime))
+            break;  /* no data arrived in the specified time */
     }
 
-done:
-    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
-
+    _wake_channel_finish(&ctx->transport_ch);
     return rc;
 }
 
@@ -144,6 +202,16 @@ void *stcp_get_context(mysocket_t sd)
     return ctx->stcp_state;
 }
 
+/* returns the value of a mysetsockopt() option, or -1 if it's unknown */
+int stcp_get_option(mysocket_t sd, int optname)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    int value;
+
+    assert(ctx);
+    return (_mysock_get_option(ctx, optname, &value) == 0) ? value : -1;
+}
+
 /* stcp_network_recv
  *
  * Receive a datagram from the peer.  The call blocks until data is
@@ -167,6 +235,37 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
     return len;
 }
 
+/* as stcp_network_recv(), but hands over the buffer the network thread
+ * read the datagram into rather than copying it out
+ */
+ssize_t stcp_network_recv_buf(mysocket_t sd, stcp_buf_t **buf, char **packet)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    ssize_t len;
+
+    assert(ctx && buf && packet);
+    len = (ssize_t) _mysock_dequeue_ref(ctx, &ctx->network_recv_queue,
+                                        buf, packet);
+
+    /* a zero-length datagram is the network thread telling us it's done */
+    assert(len <= 0 || _mysock_verify_checksum(ctx, *packet, len));
+    return len;
+}
+
+void stcp_buf_release(stcp_buf_t *buf)
+{
+    assert(buf);
+    _packet_buf_release(buf);
+}
+
+/* the largest packet, STCP header and options included, that
+ * stcp_network_send() can get to the peer in one piece.
+ */
+size_t stcp_network_max_packet(mysocket_t sd)
+{
+    return _network_max_send(sd);
+}
+
 /* stcp_network_send()
  *
  * Send data to the peer.
@@ -188,7 +287,7 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
-    char              packet[MAX_IP_PAYLOAD_LEN];
+    char              packet[MAX_PACKET_LEN];
     size_t            packet_len;
     const void       *next_buf;
     va_list           argptr;
@@ -236,14 +335,55 @@ ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
 size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
+    size_t len, queued;
+
     assert(ctx && dst);
 
     /* app may have passed in data of arbitrary length; all of it must be
      * passed down to the transport layer.  if it doesn't fit in the specified
-     * buffer, any left over is kept for the next call to app_recv().
+     * buffer, any left over is kept for the next call to app_recv().  small
+     * writes are gathered up until the buffer is full, so they can share a
+     * segment.
      */
-    return _mysock_dequeue_buffer(ctx, &ctx->app_recv_queue,
-                                  dst, max_len, TRUE);
+    len = _mysock_dequeue_buffer(ctx, &ctx->app_recv_queue,
+                                 dst, max_len, TRUE);
+    for (;;)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+        if ((queued = _mysock_queue_bytes(&ctx->app_recv_queue)) == 0)
+            ctx->app_push = FALSE;  /* everything pushed has been taken */
+        PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+        if (queued == 0 || len == max_len)
+            break;
+        len += _mysock_dequeue_buffer(ctx, &ctx->app_recv_queue,
+                                      (char *) dst + len, max_len - len, TRUE);
+    }
+    return len;
+}
+
+/* only report APP_DATA once at least bytes are waiting from the app, unless
+ * it has asked for them to be pushed out or is closing.  0 reports any data.
+ */
+void stcp_app_set_low_water(mysocket_t sd, size_t bytes)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->app_low_water = bytes;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
+
+/* the low water mark to assume while the app is corked */
+void stcp_app_set_mss(mysocket_t sd, size_t mss)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->app_mss = mss;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
 }
 
 /* pass data up to the application for consumption by myread() */
@@ -259,6 +399,54 @@ void stcp_app_send(mysocket_t sd, const void *src, size_t src_len)
     }
 }
 
+void stcp_app_send_buf(mysocket_t sd, stcp_buf_t *buf,
+                       const void *src, size_t src_len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    assert(ctx && buf && src);
+    if (src_len > 0)
+    {
+        DEBUG_LOG(("stcp_app_send_buf(%d):  passing %u bytes up to app\n",
+                   sd, src_len));
+        _mysock_enqueue_ref(ctx, &ctx->app_send_queue, buf,
+                            (const char *) src, src_len);
+    }
+}
+
+size_t stcp_app_pending(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    assert(ctx);
+    return _mysock_queue_bytes(&ctx->app_recv_queue);
+}
+
+size_t stcp_app_unread(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    assert(ctx);
+    return _mysock_queue_bytes(&ctx->app_send_queue);
+}
+
+/* report APP_DRAINED once no more than bytes are left for myread() */
+void stcp_app_set_drain_mark(mysocket_t sd, size_t bytes)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    if (_mysock_queue_bytes(&ctx->app_send_queue) <= bytes)
+    {
+        ctx->app_drain_wanted = FALSE;
+        ctx->app_drained = TRUE;
+    }
+    else
+    {
+        ctx->app_drain_mark = bytes;
+        ctx->app_drain_wanted = TRUE;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
+
 void stcp_fin_received(mysocket_t sd)
 {
     mysock_context_t *ctx = _mysock_get_context(sd);
@@ -17,7 +17,9 @@ typedef enum
     APP_DATA            = 1,
     NETWORK_DATA        = 2,
     APP_CLOSE_REQUESTED = 4,
-    ANY_EVENT           = APP_DATA | NETWORK_DATA | APP_CLOSE_REQUESTED
+    APP_DRAINED         = 8,    /* see stcp_app_set_drain_mark() */
+    ANY_EVENT           = APP_DATA | NETWORK_DATA | APP_CLOSE_REQUESTED |
+                          APP_DRAINED
 } stcp_event_type_t;
 
 
@@ -32,10 +34,10 @@ void stcp_unblock_application(mysocket_t sd);
  * or from the application, or for the application to request that the
  * socket be closed via myclose(), depending on the value of wait_flags.
  * abstime is the absolute time at which the function should quit waiting
- * (i.e., the value of the system clock at which the timeout should be
- * indicated; it has the same origin as time(2) and gettimeofday(2), so a
- * structure containing all zeros corresponds to 00:00:00 GMT, January 1,
- * 1970); if the timeout pointer is NULL, the function blocks indefinitely
+ * (i.e., the value of clock_gettime(CLOCK_MONOTONIC) at which the timeout
+ * should be indicated, so it isn't thrown off if the system clock is set; a
+ * structure containing all zeros is always in the past and so just polls);
+ * if the timeout pointer is NULL, the function blocks indefinitely
  * until data arrives.  the close event is triggered only once, once all
  * pending data has been dequeued from the application.
  *
@@ -71,6 +73,11 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
 void stcp_set_context(mysocket_t sd, const void *stcp_state);
 void *stcp_get_context(mysocket_t my_sd);
 
+/* returns the value of a mysetsockopt() option (MYSO_*) for the given
+ * mysocket, or -1 if the option is unknown.
+ */
+int stcp_get_option(mysocket_t sd, int optname);
+
 /* Receive a datagram from the peer.
  *
  * sd       Mysocket descriptor.
@@ -81,6 +88,21 @@ void *stcp_get_context(mysocket_t my_sd);
  */
 ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
 
+/* Receive a datagram from the peer without copying it.
+ *
+ * sd       Mysocket descriptor.
+ * buf      Set to the buffer the datagram is in, which the caller now holds
+ *          a reference to and must give back with stcp_buf_release().
+ * packet   Set to the start of the datagram, within buf.
+ *
+ * This call returns the length of the datagram, as stcp_network_recv().
+ */
+typedef struct packet_buf stcp_buf_t;
+
+ssize_t stcp_network_recv_buf(mysocket_t sd, stcp_buf_t **buf, char **packet);
+
+void stcp_buf_release(stcp_buf_t *buf);
+
 /* Send data to the peer.
  *
  * sd           Mysocket descriptor
@@ -98,12 +120,56 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
  */
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...);
 
-/* receive data from the application (sent to us using mywrite()) */
+/* The largest datagram, STCP header and options included, the network
+ * under sd can carry.  Use it to pick the MSS to advertise.
+ */
+size_t stcp_network_max_packet(mysocket_t sd);
+
+/* receive data from the application (sent to us using mywrite()).  data
+ * from several writes is gathered into dst, up to max_len bytes.
+ */
 size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len);
 
-/* pass data up to the application for consumption by myread() */
+/* bytes the application has written that stcp_app_recv() hasn't taken yet */
+size_t stcp_app_pending(mysocket_t sd);
+
+/* hold back the APP_DATA event until at least bytes are waiting from the
+ * application, e.g. to only send full segments (Nagle's algorithm).  data
+ * the app has pushed with myflush(), or left behind on myclose(), is
+ * reported regardless.  0 (the default) reports any data at all.
+ */
+void stcp_app_set_low_water(mysocket_t sd, size_t bytes);
+
+/* the send MSS negotiated for the connection.  writes the app has corked
+ * (MYSO_CORK) are held back until there's a segment of them, from the
+ * moment it corks, even before the next stcp_app_set_low_water().
+ */
+void stcp_app_set_mss(mysocket_t sd, size_t mss);
+
+/* pass data up to the application for consumption by myread().  this
+ * never waits for the app to read:  once the queue is full, data is held
+ * back until it has room, still counting towards stcp_app_unread().
+ */
 void stcp_app_send(mysocket_t sd, const void *src, size_t src_len);
 
+/* the same, for data that lies in buf (from stcp_network_recv_buf()).  it
+ * isn't copied:  the app's queue keeps a reference to buf until it's read.
+ */
+void stcp_app_send_buf(mysocket_t sd, stcp_buf_t *buf,
+                       const void *src, size_t src_len);
+
+/* bytes passed up with stcp_app_send() that the application hasn't read
+ * yet.  they count against the receive window.
+ */
+size_t stcp_app_unread(mysocket_t sd);
+
+/* report APP_DRAINED once the application has read its way down to no
+ * more than bytes unread (straight away if it already has), e.g. so a
+ * window the app had filled can be reopened.  the mark is cleared once
+ * it has been reported.
+ */
+void stcp_app_set_drain_mark(mysocket_t sd, size_t bytes);
+
 /* once you receive a FIN segment from the peer, we need to let the
  * application know there's no more data arriving (by returning 0 bytes for
  * subsequent myread() calls).  call stcp_fin_received() to indicate the
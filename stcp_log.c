@@ -0,0 +1,245 @@
+/*
+ * stcp_log.c
+ *
+ * per-thread log rings and the thread that drains them.  each ring has
+ * one producer (its thread) and one consumer (whoever holds ring_lock
+ * while draining), so head and tail are all the synchronisation needed
+ * between them.  the flusher sleeps on a wake channel once it finds every
+ * ring empty, and a thread rings it when it writes into a ring the
+ * flusher has emptied; the flusher's timed wait is only a fallback.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include "mysock_impl.h"
+#include "stcp_log.h"
+
+#define LOG_RING_LEN 256            /* records per thread, a power of two */
+#define LOG_MSG_LEN 120
+#define LOG_FLUSH_FALLBACK_S 1     /* longest the flusher sleeps */
+
+typedef struct
+{
+    struct timespec when;
+    int level;
+    char text[LOG_MSG_LEN];
+} log_record_t;
+
+typedef struct log_ring
+{
+    std::atomic<uint32_t> head;     /* next record the thread writes */
+    std::atomic<uint32_t> tail;     /* next record the flusher reads */
+    std::atomic<uint32_t> dropped;  /* messages lost to a full ring */
+    uint32_t dropped_reported;
+    std::atomic<bool> closed;       /* its thread has exited */
+    unsigned int id;
+    struct log_ring *next;
+    log_record_t records[LOG_RING_LEN];
+} log_ring_t;
+
+std::atomic<int> stcp_log_level(STCP_LOG_DEFAULT_LEVEL);
+
+static const char *level_names[] = { "error", "warn", "info", "debug", "trace" };
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t *rings;           /* every live ring, under ring_lock */
+static unsigned int next_ring_id;
+static __thread log_ring_t *my_ring;
+static wake_channel_t flusher_ch;
+
+
+static bool drain_rings(void);
+
+/* the thread a ring belongs to has gone; the flusher frees the ring once
+ * it has written out what's left.
+ */
+static void ring_release(void *arg)
+{
+    log_ring_t *ring = (log_ring_t *) arg;
+    ring->closed.store(true, std::memory_order_release);
+}
+
+static log_ring_t *ring_register(void)
+{
+    log_ring_t *ring = (log_ring_t *) calloc(1, sizeof(log_ring_t));
+    assert(ring);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ring_lock));
+    ring->id = next_ring_id++;
+    ring->next = rings;
+    rings = ring;
+    PTHREAD_CALL(pthread_mutex_unlock(&ring_lock));
+
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+static void *flusher(void *arg)
+{
+    for (;;)
+    {
+        struct timespec abstime;
+        uint32_t seq;
+
+        if (drain_rings())
+            continue;
+
+        /* nothing there; say we're about to sleep, then look once more */
+        seq = _wake_channel_prepare(&flusher_ch, WAKE_ANY);
+        if (!drain_rings())
+        {
+            clock_gettime(CLOCK_MONOTONIC, &abstime);
+            abstime.tv_sec += LOG_FLUSH_FALLBACK_S;
+            (void) _wake_channel_sleep(&flusher_ch, seq, &abstime);
+        }
+        _wake_channel_finish(&flusher_ch);
+    }
+    return NULL;
+}
+
+static int parse_level(const char *s)
+{
+    unsigned int i;
+
+    if (s[0] >= '0' && s[0] <= '9')
+        return atoi(s);
+    for (i = 0; i < sizeof(level_names) / sizeof(level_names[0]); ++i)
+    {
+        if (!strcasecmp(s, level_names[i]))
+            return (int) i;
+    }
+    return STCP_LOG_DEFAULT_LEVEL;
+}
+
+static void log_start(void)
+{
+    const char *env = getenv("STCP_LOG_LEVEL");
+    pthread_t tid;
+
+    if (env && *env)
+        stcp_log_level.store(parse_level(env), std::memory_order_relaxed);
+
+    _wake_channel_init(&flusher_ch);
+    PTHREAD_CALL(pthread_key_create(&ring_key, ring_release));
+    PTHREAD_CALL(pthread_create(&tid, NULL, flusher, NULL));
+    PTHREAD_CALL(pthread_detach(tid));
+    atexit(stcp_log_flush);
+}
+
+void stcp_log_init(void)
+{
+    PTHREAD_CALL(pthread_once(&log_once, log_start));
+}
+
+void stcp_log_set_level(int level)
+{
+    stcp_log_level.store(level, std::memory_order_relaxed);
+}
+
+void stcp_log_write(int level, const char *format, ...)
+{
+    log_ring_t *ring = my_ring;
+    log_record_t *rec;
+    uint32_t head;
+    va_list argptr;
+
+    if (!ring)
+    {
+        stcp_log_init();
+        ring = ring_register();
+    }
+
+    head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= LOG_RING_LEN)
+    {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    rec = &ring->records[head & (LOG_RING_LEN - 1)];
+    clock_gettime(CLOCK_REALTIME, &rec->when);
+    rec->level = level;
+    va_start(argptr, format);
+    vsnprintf(rec->text, sizeof(rec->text), format, argptr);
+    va_end(argptr);
+
+    /* if the flusher has emptied the ring up to this record, it may be
+     * asleep, or about to be.  (head and tail are seq_cst on both sides, so
+     * either we see the flusher's tail, or its next look sees our head.)
+     */
+    ring->head.store(head + 1, std::memory_order_seq_cst);
+    if (ring->tail.load(std::memory_order_seq_cst) == head)
+        _wake_channel_wake(&flusher_ch, WAKE_ANY);
+}
+
+static void write_record(const log_ring_t *ring, const log_record_t *rec)
+{
+    const char *name = (rec->level >= 0 && rec->level <= STCP_LOG_TRACE) ?
+        level_names[rec->level] : "?";
+
+    fprintf(stdout, "%ld.%06ld %-5s [%u] %s\n", (long) rec->when.tv_sec,
+            rec->when.tv_nsec / 1000, name, ring->id, rec->text);
+}
+
+/* write out what's in every ring.  returns true if there was anything. */
+static bool drain_rings(void)
+{
+    log_ring_t **link;
+    bool wrote = false;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ring_lock));
+    link = &rings;
+    while (*link)
+    {
+        log_ring_t *ring = *link;
+        bool closed = ring->closed.load(std::memory_order_acquire);
+        uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint32_t head = ring->head.load(std::memory_order_seq_cst);
+        uint32_t dropped = ring->dropped.load(std::memory_order_relaxed);
+
+        for (; tail != head; ++tail)
+        {
+            write_record(ring, &ring->records[tail & (LOG_RING_LEN - 1)]);
+            wrote = true;
+        }
+        ring->tail.store(tail, std::memory_order_seq_cst);
+
+        if (dropped != ring->dropped_reported)
+        {
+            fprintf(stdout, "log [%u]: %u messages dropped\n", ring->id,
+                    dropped - ring->dropped_reported);
+            ring->dropped_reported = dropped;
+            wrote = true;
+        }
+
+        if (closed)
+        {
+            *link = ring->next;
+            free(ring);
+        }
+        else
+        {
+            link = &ring->next;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ring_lock));
+
+    if (wrote)
+        fflush(stdout);
+    return wrote;
+}
+
+void stcp_log_flush(void)
+{
+    (void) drain_rings();
+}
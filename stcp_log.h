@@ -0,0 +1,55 @@
+/* stcp_log.h--leveled logging for the STCP layers.
+ *
+ * a message is formatted into a ring buffer owned by the calling thread,
+ * with no locks and no I/O; a background thread drains the rings to
+ * stdout.  levels above STCP_LOG_COMPILE_LEVEL are compiled out entirely,
+ * and the rest are filtered at run time by the STCP_LOG_LEVEL environment
+ * variable (a level name or number) or stcp_log_set_level().  if a ring
+ * fills up, messages are dropped and the count reported, rather than
+ * holding up the caller.
+ */
+
+#ifndef __STCP_LOG_H__
+#define __STCP_LOG_H__
+
+#include <atomic>
+
+#define STCP_LOG_ERROR  0
+#define STCP_LOG_WARN   1
+#define STCP_LOG_INFO   2
+#define STCP_LOG_DEBUG  3
+#define STCP_LOG_TRACE  4   /* per segment */
+
+#ifndef STCP_LOG_COMPILE_LEVEL
+    #define STCP_LOG_COMPILE_LEVEL STCP_LOG_DEBUG
+#endif
+
+#define STCP_LOG_DEFAULT_LEVEL STCP_LOG_WARN
+
+extern std::atomic<int> stcp_log_level;
+
+/* reads STCP_LOG_LEVEL and starts the flusher; safe to call repeatedly */
+void stcp_log_init(void);
+void stcp_log_set_level(int level);
+
+/* formats one message into this thread's ring; use the macros instead */
+void stcp_log_write(int level, const char *format, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+/* writes out whatever the rings hold now */
+void stcp_log_flush(void);
+
+#define STCP_LOG(level, ...) \
+    do { \
+        if ((level) <= STCP_LOG_COMPILE_LEVEL && \
+            (level) <= stcp_log_level.load(std::memory_order_relaxed)) \
+            stcp_log_write((level), __VA_ARGS__); \
+    } while (0)
+
+#define LOG_ERROR(...) STCP_LOG(STCP_LOG_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)  STCP_LOG(STCP_LOG_WARN, __VA_ARGS__)
+#define LOG_INFO(...)  STCP_LOG(STCP_LOG_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) STCP_LOG(STCP_LOG_DEBUG, __VA_ARGS__)
+#define LOG_TRACE(...) STCP_LOG(STCP_LOG_TRACE, __VA_ARGS__)
+
+#endif  /* __STCP_LOG_H__ */
@@ -0,0 +1,212 @@
+/*
+ * timer_wheel.c
+ *
+ * the hierarchical timing wheel behind the transport's timers (Varghese
+ * and Lauck's scheme 7).  a timer sits in the lowest level whose span
+ * covers how far off it is, in the slot its expiry tick maps to there.
+ * whenever level 0 wraps, the next slot of level 1 is emptied back into
+ * the wheel, and so on up.
+ *
+ */
+
+#include <string.h>
+#include <assert.h>
+#include "transport.h"
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TW_SLOTS - 1)
+
+static int level_shift(int level){
+    return level * TW_SLOT_BITS;
+}
+
+static void link_timer(timer_wheel_t *tw, stcp_timer_t *timer){
+    uint64_t delta = timer->expires - tw->now;
+    uint64_t placed = timer->expires;
+    int level = 0;
+
+    //anything further off than the wheel reaches waits in the top level
+    //and gets placed again when its slot comes round
+    if(delta >= TW_MAX_DELTA){
+        placed = tw->now + TW_MAX_DELTA - 1;
+        delta = TW_MAX_DELTA - 1;
+    }
+    while(delta >= ((uint64_t) TW_SLOTS << level_shift(level))){
+        level++;
+    }
+
+    int slot = (int)((placed >> level_shift(level)) & SLOT_MASK);
+    stcp_timer_t **head = &tw->slots[level][slot];
+
+    timer->next = *head;
+    if(*head){
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+    timer->level = level;
+    timer->slot = slot;
+    tw->occupied[level] |= (uint64_t) 1 << slot;
+}
+
+//takes the timer off its slot, keeping the occupancy bit in step
+static void unlink_timer(timer_wheel_t *tw, stcp_timer_t *timer){
+    *timer->pprev = timer->next;
+    if(timer->next){
+        timer->next->pprev = timer->pprev;
+    }
+    if(!tw->slots[timer->level][timer->slot]){
+        tw->occupied[timer->level] &= ~((uint64_t) 1 << timer->slot);
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+void tw_init(timer_wheel_t *tw, uint64_t now){
+    memset(tw, 0, sizeof(*tw));
+    tw->now = now;
+}
+
+void tw_timer_init(stcp_timer_t *timer, timer_fn fn, void *arg){
+    memset(timer, 0, sizeof(*timer));
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+void tw_arm(timer_wheel_t *tw, stcp_timer_t *timer, uint64_t expires){
+    if(tw_pending(timer)){
+        unlink_timer(tw, timer);
+    } else {
+        tw->count++;
+    }
+    timer->expires = expires > tw->now ? expires : tw->now + 1;
+    link_timer(tw, timer);
+}
+
+void tw_cancel(timer_wheel_t *tw, stcp_timer_t *timer){
+    if(tw_pending(timer)){
+        unlink_timer(tw, timer);
+        tw->count--;
+    }
+}
+
+//empties one slot of an upper level back into the wheel
+static void cascade(timer_wheel_t *tw, int level, int slot){
+    stcp_timer_t *timer = tw->slots[level][slot];
+
+    tw->slots[level][slot] = NULL;
+    tw->occupied[level] &= ~((uint64_t) 1 << slot);
+    while(timer){
+        stcp_timer_t *next = timer->next;
+        link_timer(tw, timer);
+        timer = next;
+    }
+}
+
+/* moves the wheel straight to tick now, which must be before anything is
+ * due, and places every timer again from there.  that's the cascading the
+ * skipped ticks would have done.
+ */
+static void rebase(timer_wheel_t *tw, uint64_t now){
+    stcp_timer_t *all = NULL;
+
+    for(int level = 0;level<TW_LEVELS;level++){
+        for(int slot = 0;slot<TW_SLOTS;slot++){
+            stcp_timer_t *timer = tw->slots[level][slot];
+            while(timer){
+                stcp_timer_t *next = timer->next;
+                timer->next = all;
+                all = timer;
+                timer = next;
+            }
+            tw->slots[level][slot] = NULL;
+        }
+        tw->occupied[level] = 0;
+    }
+
+    tw->now = now;
+    while(all){
+        stcp_timer_t *next = all->next;
+        link_timer(tw, all);
+        all = next;
+    }
+}
+
+int tw_advance(timer_wheel_t *tw, uint64_t now){
+    int fired = 0;
+    uint64_t next;
+
+    while(tw->now < now){
+        if(tw->count == 0){
+            //nothing to run or move down, so skip straight there
+            tw->now = now;
+            break;
+        }
+        //after a long sleep, jump to just short of the next timer rather
+        //than step through every tick on the way.  there are only ever a
+        //few timers per wheel, so placing them again is cheap
+        if(now - tw->now > TW_SLOTS && tw_next_expiry(tw, &next) && next - 1 > tw->now){
+            rebase(tw, MIN(now, next - 1));
+            continue;
+        }
+        tw->now++;
+
+        for(int level = 1;level<TW_LEVELS;level++){
+            uint64_t span = (uint64_t) 1 << level_shift(level);
+            if(tw->now & (span - 1)){
+                break;
+            }
+            cascade(tw, level, (int)((tw->now >> level_shift(level)) & SLOT_MASK));
+        }
+
+        //a callback may arm timers of its own, which always land past now
+        stcp_timer_t **slot = &tw->slots[0][tw->now & SLOT_MASK];
+        while(*slot){
+            stcp_timer_t *timer = *slot;
+            assert(timer->expires == tw->now);
+            unlink_timer(tw, timer);
+            tw->count--;
+            fired++;
+            timer->fn(timer, timer->arg);
+        }
+    }
+    return fired;
+}
+
+/* the first occupied slot after the one the wheel is on, going round.  the
+ * current slot itself comes last: anything in it is a whole turn away.
+ */
+static int next_slot(uint64_t occupied, int current){
+    int start = (current + 1) & SLOT_MASK;
+    uint64_t rotated = start ? (occupied >> start) | (occupied << (TW_SLOTS - start)) : occupied;
+
+    if(!rotated){
+        return -1;
+    }
+    return (start + __builtin_ctzll(rotated)) & SLOT_MASK;
+}
+
+bool tw_next_expiry(const timer_wheel_t *tw, uint64_t *expires){
+    bool found = false;
+
+    if(tw->count == 0){
+        return false;
+    }
+    for(int level = 0;level<TW_LEVELS;level++){
+        int current = (int)((tw->now >> level_shift(level)) & SLOT_MASK);
+        int slot = next_slot(tw->occupied[level], current);
+
+        if(slot < 0){
+            continue;
+        }
+        //the slots of one level cover consecutive spans, so the earliest
+        //timer of the level is in its first occupied slot
+        for(const stcp_timer_t *t = tw->slots[level][slot];t;t = t->next){
+            if(!found || t->expires < *expires){
+                *expires = t->expires;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
@@ -0,0 +1,70 @@
+/* timer_wheel.h--hierarchical timing wheel for the STCP transport.
+ *
+ * each connection keeps its timers (retransmission, delayed ack,
+ * keepalive) on a wheel of TW_LEVELS levels of TW_SLOTS slots.  level 0
+ * holds the timers due within TW_SLOTS ticks, one slot per tick; each
+ * level above covers TW_SLOTS times the span of the one below, and its
+ * timers drop down a level as their slot comes round.  arming and
+ * cancelling are O(1), and finding the next expiry looks at one slot per
+ * level.  the wheel doesn't read a clock itself: callers pass the current
+ * tick in, on whatever monotonic clock they like.
+ */
+
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <stdint.h>
+
+#define TW_LEVELS       4
+#define TW_SLOT_BITS    6
+#define TW_SLOTS        (1 << TW_SLOT_BITS)
+#define TW_MAX_DELTA    ((uint64_t) 1 << (TW_SLOT_BITS * TW_LEVELS))    /* ticks */
+
+struct stcp_timer;
+
+typedef void (*timer_fn)(struct stcp_timer *timer, void *arg);
+
+/* one timer.  it lives in whatever structure owns it; the wheel only links
+ * it into a slot while it's armed.
+ */
+typedef struct stcp_timer
+{
+    struct stcp_timer *next;
+    struct stcp_timer **pprev;  /* whatever points at us, NULL when idle */
+    uint64_t expires;           /* tick it's due on */
+    int level;                  /* where it's linked, while armed */
+    int slot;
+    timer_fn fn;
+    void *arg;
+} stcp_timer_t;
+
+typedef struct
+{
+    uint64_t now;               /* last tick expired */
+    unsigned int count;         /* timers armed */
+    uint64_t occupied[TW_LEVELS];   /* bit per non-empty slot */
+    stcp_timer_t *slots[TW_LEVELS][TW_SLOTS];
+} timer_wheel_t;
+
+
+void tw_init(timer_wheel_t *tw, uint64_t now);
+void tw_timer_init(stcp_timer_t *timer, timer_fn fn, void *arg);
+
+/* (re)arms timer to go off on tick expires; one already due goes off at
+ * the next tick
+ */
+void tw_arm(timer_wheel_t *tw, stcp_timer_t *timer, uint64_t expires);
+void tw_cancel(timer_wheel_t *tw, stcp_timer_t *timer);
+
+/* runs every timer due by tick now, in order; returns how many */
+int tw_advance(timer_wheel_t *tw, uint64_t now);
+
+/* the tick the earliest armed timer is due on, false if there are none */
+bool tw_next_expiry(const timer_wheel_t *tw, uint64_t *expires);
+
+static inline bool tw_pending(const stcp_timer_t *timer)
+{
+    return timer->pprev != NULL;
+}
+
+#endif  /* __TIMER_WHEEL_H__ */
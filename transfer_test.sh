@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# transfer_test.sh
+#
+# fetches a file of random bytes from a fresh server with the client, and
+# checks what arrived against what was sent.  anything after a -- is
+# passed to both programs (e.g. -- -c bbr).
+#
+# usage: transfer_test.sh [-s bytes] [-t seconds] [-- program options]
+#
+
+size=2000000
+limit=60
+while getopts s:t: opt; do
+    case $opt in
+    s)  size=$OPTARG ;;
+    t)  limit=$OPTARG ;;
+    *)  echo "usage: $0 [-s bytes] [-t seconds] [-- program options]" >&2
+        exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+bin=$(cd "$(dirname "$0")" && pwd)
+dir=$(mktemp -d "${TMPDIR:-/tmp}/stcp_test.XXXXXX") || exit 1
+trap 'kill $server 2>/dev/null; rm -rf "$dir"' EXIT
+cd "$dir" || exit 1
+
+head -c "$size" /dev/urandom > sent
+
+timeout "$limit" "$bin/server" "$@" > server.log 2>&1 &
+server=$!
+
+# the server prints where it's listening once it's ready
+port=
+for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+    port=$(sed -n 's/^Server.s address is .*:\([0-9]*\)$/\1/p' server.log)
+    [ -n "$port" ] && break
+    sleep 0.1
+done
+if [ -z "$port" ]; then
+    echo "transfer_test: server didn't start" >&2
+    cat server.log >&2
+    exit 1
+fi
+
+if ! timeout "$limit" "$bin/client" "$@" -f sent "127.0.0.1:$port" \
+        > client.log 2>&1; then
+    echo "transfer_test ($*): client failed" >&2
+    tail -5 client.log >&2
+    exit 1
+fi
+if ! cmp -s sent rcvd; then
+    echo "transfer_test ($*): received file differs" >&2
+    exit 1
+fi
+echo "transfer_test ($*): $size bytes ok"
@@ -20,70 +20,191 @@
 #include "mysock.h"
 #include "stcp_api.h"
 #include "transport.h"
+#include "congestion.h"
+#include "stcp_log.h"
+#include "timer_wheel.h"
 
-#include <string>
 #include <cstdlib>
 #include <ctime>
-#include <map>
-#include <functional>
-#include <iostream>
+#include <time.h>
+#include <sys/uio.h>
+
+#define BUF_INITIAL (16 * 1024)             /* autotuned buffers start here... */
+#define BUF_AUTOTUNE_MAX (4 * 1024 * 1024)  /* ...and grow up to this */
+#define RTX_QUEUE_LEN 64        /* initial retransmission queue slots (power of two) */
+#define RTO_INITIAL_US 1000000  /* RTO before the first RTT sample (RFC 6298) */
+#define RTO_MIN_US 200000       /* floor, so delayed acks don't cause spurious resends */
+#define RTO_MAX_US 60000000     /* ceiling for exponential backoff */
+#define TS_RECENT_IDLE_US (24ULL * 24 * 3600 * 1000000) /* ts_recent lapses after 24 days' silence */
+#define TIMER_TICK_US 1000      /* resolution of the timer wheel */
+#define CLOCK_GRANULARITY_US TIMER_TICK_US
+#define MAX_RETRANSMITS 6       /* give up on the peer after this many */
+#define DUPACK_THRESHOLD 3      /* dup acks before we fast retransmit */
+#define MAX_OOO_RANGES 32       /* out-of-order runs the receiver keeps track of */
+#define MAX_SACK_BLOCKS 4       /* as many as fit in the option space, 3 with timestamps */
+#define NET_BATCH_MAX 64        /* segments handled per wakeup before timers get a look in */
+#define PACING_BURST_SEGS 2     /* segments that may always leave back to back */
+#define PACING_SS_GAIN 200      /* percent of cwnd/SRTT paced at in slow start... */
+#define PACING_CA_GAIN 120      /* ...and once past it */
+#define KEEPALIVE_INTERVAL_US 75000000L /* between unanswered probes (RFC 1122 4.2.3.6)... */
+#define KEEPALIVE_PROBES 9      /* ...and how many before we give up */
+
+//sequence numbers wrap, so compare them as a signed distance
+#define SEQ_LT(a,b)  ((int32_t)((a)-(b)) < 0)
+#define SEQ_LEQ(a,b) ((int32_t)((a)-(b)) <= 0)
+#define SEQ_GT(a,b)  ((int32_t)((a)-(b)) > 0)
+#define SEQ_GEQ(a,b) ((int32_t)((a)-(b)) >= 0)
+
+
+/* byte ring buffer.  the size is a power of two so offsets wrap with a
+ * mask, and start/end are free-running counters: end - start is how much
+ * is in it, and a full buffer doesn't need a spare slot to tell it from an
+ * empty one.
+ */
+struct ringBuffer{
+    uint32_t start=0;   //first byte in the window
+    uint32_t end=0;     //one past the last
+    uint32_t mask=0;    //size - 1
+    char* buffer=nullptr;
+};
 
-#define MAXBUF 3072
-#define HANDSHAKE_PRINT 1
-#define HANDSHAKE_LOOP_PRINT 0
-#define ESTABLISHED_PRINT 1
+static uint32_t roundUpPow2(uint32_t n){
+    uint32_t size=1;
+    while(size<n){
+        size<<=1;
+    }
+    return size;
+}
 
+void ringInit(ringBuffer* in, uint32_t size){
+    size=roundUpPow2(size);
+    in->buffer=(char*)malloc(size);
+    assert(in->buffer);
+    in->mask=size-1;
+    in->start=0;
+    in->end=0;
+}
 
+void ringDestroy(ringBuffer* in){
+    free(in->buffer);
+    in->buffer=nullptr;
+    in->mask=0;
+}
 
-struct cBuffer{
-    int start=0;
-    int end=0;
-    char buffer[MAXBUF];
-};
+uint32_t ringCapacity(const ringBuffer* in){
+    return in->mask+1;
+}
+
+uint32_t ringUsed(const ringBuffer* in){
+    return in->end-in->start;
+}
+
+uint32_t ringSpace(const ringBuffer* in){
+    return ringCapacity(in)-ringUsed(in);
+}
+
+/* describes len bytes starting offset bytes into the window as at most two
+ * contiguous pieces (two if it wraps).  returns how many pieces are used.
+ */
+int ringReadable(const ringBuffer* in, uint32_t offset, uint32_t len, struct iovec iov[2]){
+    uint32_t pos=(in->start+offset)&in->mask;
+    uint32_t first=MIN(len, ringCapacity(in)-pos);
+
+    iov[0].iov_base=in->buffer+pos;
+    iov[0].iov_len=first;
+    iov[1].iov_base=in->buffer;
+    iov[1].iov_len=len-first;
+    return iov[1].iov_len ? 2 : 1;
+}
+
+//the free space after the window, as at most two contiguous pieces
+int ringWritable(const ringBuffer* in, struct iovec iov[2]){
+    uint32_t pos=in->end&in->mask;
+    uint32_t space=ringSpace(in);
+    uint32_t first=MIN(space, ringCapacity(in)-pos);
+
+    iov[0].iov_base=in->buffer+pos;
+    iov[0].iov_len=first;
+    iov[1].iov_base=in->buffer;
+    iov[1].iov_len=space-first;
+    return iov[1].iov_len ? 2 : 1;
+}
+
+//adds len bytes already written through ringWritable() to the window
+void ringCommit(ringBuffer* in, uint32_t len){
+    in->end+=MIN(len, ringSpace(in));
+}
+
+//copies len bytes in at offset bytes into the window; the caller checks they fit
+static void ringCopyIn(ringBuffer* in, uint32_t offset, const char* data, uint32_t len){
+    uint32_t pos=(in->start+offset)&in->mask;
+    uint32_t first=MIN(len, ringCapacity(in)-pos);
 
-int getSize(cBuffer* in){
-    return (in->end - in->start + MAXBUF) % MAXBUF;
+    memcpy(in->buffer+pos, data, first);
+    memcpy(in->buffer, data+first, len-first);
 }
 
-int slideWindow(cBuffer* in, int amount){
-    if(amount>getSize(in)){
+//appends as much of data as fits, returns how much that was
+uint32_t ringWrite(ringBuffer* in, const char* data, uint32_t len){
+    len=MIN(len, ringSpace(in));
+    ringCopyIn(in, ringUsed(in), data, len);
+    in->end+=len;
+    return len;
+}
+
+//writes len bytes offset bytes into the window, growing it to cover them
+int ringWriteAt(ringBuffer* in, uint32_t offset, const char* data, uint32_t len){
+    if(offset+len>ringCapacity(in)){
         return -1;
     }
-    in->start+=amount;
-    in->start=in->start%MAXBUF;
-    return 1;
+    ringCopyIn(in, offset, data, len);
+    if(offset+len>ringUsed(in)){
+        in->end=in->start+offset+len;
+    }
+    return (int)len;
 }
 
-char* getWindow(cBuffer* in){
-    int size=getSize(in);
-    char* out=new char[size];
-    if(size!=0){
-        out[size-1]=0;
+//moves the start of the window forward, even past the end
+void ringConsume(ringBuffer* in, uint32_t amount){
+    if(amount>=ringUsed(in)){
+        in->end=in->start+amount;
     }
-    for(int i = 0;i<size;i++){
-        out[i]=in->buffer[(in->start+i)%MAXBUF];
+    in->start+=amount;
+}
+
+//copies len bytes starting offset bytes into the window, without consuming them
+int ringPeek(const ringBuffer* in, uint32_t offset, char* out, uint32_t len){
+    struct iovec iov[2];
+
+    if(offset+len>ringUsed(in)){
+        return -1;
     }
-    return out;
+    ringReadable(in, offset, len, iov);
+    memcpy(out, iov[0].iov_base, iov[0].iov_len);
+    memcpy(out+iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+    return (int)len;
 }
 
-int insertWindow(cBuffer* in, char* inString){
-    int totalAdded=0;
-    for(size_t i = 0;i<strlen(inString);i++){
-        if(getSize(in)+1>=MAXBUF){
-            break;
-        }
-        in->buffer[(in->end)%MAXBUF]=inString[i];
-        in->buffer[(in->end+1)%MAXBUF]=0;
-        totalAdded++;
-        in->end++;
+//reallocates the buffer to hold at least size bytes, keeping the window
+void ringGrow(ringBuffer* in, uint32_t size){
+    size=roundUpPow2(size);
+    if(size<=ringCapacity(in)){
+        return;
     }
-    return totalAdded;
+    uint32_t used=ringUsed(in);
+    char* bigger=(char*)malloc(size);
+    assert(bigger);
+    ringPeek(in, 0, bigger, used);
+    free(in->buffer);
+    in->buffer=bigger;
+    in->mask=size-1;
+    in->start=0;
+    in->end=used;
 }
 
 int calcCheckSum(tcphdr input){
     int size=sizeof(tcphdr);
-    char * interpretBuffer=(char*)malloc(size);
-    memcpy(interpretBuffer,(const void*)&input,size);
+    const char * interpretBuffer=(const char*)&input;
     int intermediary=0;
     int total=0;
     for(int i=0;i<size;i++){
@@ -135,29 +256,184 @@ typedef enum State {
     ERROR_REFUSED,
     ERROR_ABORTED,
 
-
+    NUM_STATES
 } State;
 
+/* what moves the connection on from a state.  several can be pending at
+ * once (a FIN can arrive while ours is still unacked), so they're checked
+ * in this order and the first one the state reacts to wins.
+ */
+typedef enum Event {
+    EV_STEP,            /* nothing to wait for, the next step just runs */
+    EV_FIN_RECEIVED,    /* peer's FIN has arrived in order */
+    EV_FIN_ACKED,       /* peer has acked our FIN */
+    EV_APP_CLOSE,       /* myclose() has been called */
+
+    NUM_EVENTS
+} Event;
+
+/* one entry of the retransmission queue.  the payload itself stays in
+ * current_buffer until it is acked; this only remembers where it starts.
+ */
+typedef struct
+{
+    tcp_seq seq;                /* first sequence number of the segment */
+    uint16_t len;               /* payload bytes */
+    uint8_t flags;              /* TH_FIN for the closing segment */
+    int retransmits;            /* times this segment has been resent */
+    struct timespec sent_at;    /* last (re)transmission */
+
+    //scoreboard (RFC 6675)
+    bool_t sacked;              /* peer holds it, just not in order yet */
+    bool_t lost;                /* presumed lost and due to be resent... */
+    bool_t resent;              /* ...and it has been since */
+} segment_t;
+
+/* a run of out-of-order bytes held in opposite_buffer, [start, end) */
+typedef struct
+{
+    tcp_seq start;
+    tcp_seq end;
+} seq_range_t;
+
+/* what we understood of the options on an incoming segment */
+typedef struct
+{
+    bool_t mss_present;
+    int mss;
+    bool_t sack_permitted;
+    bool_t wscale_present;
+    int wscale;
+    bool_t ts_present;
+    uint32_t tsval;
+    uint32_t tsecr;
+    int sack_count;
+    seq_range_t sack[MAX_SACK_BLOCKS];
+} tcp_options_t;
+
+/* sequence space taken up by a segment; FIN counts as one byte */
+#define SEG_SEQ_LEN(s) ((s)->len + (((s)->flags & TH_FIN) ? 1 : 0))
+
 /* this structure is global to a mysocket descriptor */
 typedef struct
 {
     bool_t done;    /* TRUE once connection is closed */
+    mysocket_t sd;
 
     State state;   /* state of the connection (established, etc.) */
 
     tcp_seq initial_sequence_num;
-    tcp_seq current_sequence_num;
-    tcp_seq opposite_current_sequence_num;
+    tcp_seq current_sequence_num;           /* next seq we will send */
+    tcp_seq unacked_sequence_num;           /* oldest seq not yet acked */
+    tcp_seq opposite_current_sequence_num;  /* next seq we expect */
 
     /* any other connection-wide global variables go here */
     int tcp_opposite_window_size; 
     int tcp_window_size;
-
-    cBuffer current_buffer;
-    cBuffer opposite_buffer;
+    tcp_seq snd_wl1;    /* seq of the segment the peer's window came from */
+    tcp_seq snd_wl2;    /* and its ack */
+
+    //holds everything from unacked_sequence_num up to current_sequence_num
+    ringBuffer current_buffer;
+    //reassembly buffer, starts at opposite_current_sequence_num.  in-order
+    //data goes straight up to the app, so only data past a hole lands here
+    ringBuffer opposite_buffer;
+    seq_range_t ooo_ranges[MAX_OOO_RANGES];    /* sorted, non-overlapping */
+    int ooo_count;
+    tcp_seq last_ooo_seq;   /* latest out-of-order arrival, reported first */
+
+    bool_t sack_permitted;  /* both ends offered SACK in the handshake */
+
+    //window scaling (RFC 7323), only if both ends offered it on their SYN
+    bool_t wscale_ok;
+    int rcv_wscale;         /* shift applied to the windows we advertise */
+    int snd_wscale;         /* shift applied to the windows the peer advertises */
+
+    //timestamps (RFC 7323), again only if both SYNs carried them
+    bool_t ts_ok;
+    uint32_t ts_recent;     /* peer's clock as of its latest in-order segment */
+    uint64_t ts_recent_us;  /* clock_us() when ts_recent was taken */
+    tcp_seq last_ack_sent;  /* ack field of the last segment we sent */
+
+    //buffer sizes.  MYSO_SNDBUF/MYSO_RCVBUF fix them, otherwise they start
+    //small and grow with the bandwidth-delay product up to *_max
+    bool_t sndbuf_auto;
+    bool_t rcvbuf_auto;
+    int sndbuf_max;
+    int rcvbuf_max;
+    int rcv_space_bytes;            /* delivered to the app this round trip */
+    struct timespec rcv_space_stamp;
+    struct timespec syn_sent_at;    /* for an RTT sample off the handshake */
+
+    //delayed acks (RFC 1122 4.2.3.2, RFC 5681 4.2)
+    long delack_us;         /* 0 acks every segment straight away */
+    int delack_bytes;       /* in-order bytes taken since our last ack */
+    bool_t ack_pending;     /* delack_timer is running */
+    bool_t ack_now;         /* owed as soon as the current batch is handled */
+    uint32_t last_adv_window;       /* window on the last ack we sent */
+    bool_t drain_mark_set;  /* waiting on APP_DRAINED to reopen the window */
+
+    //segments in flight, oldest first.  it doubles whenever it fills up
+    segment_t *rtx_queue;
+    int rtx_cap;            /* power of two */
+    int rtx_start;
+    int rtx_count;
+
+    //round-trip estimator, all in microseconds (RFC 6298)
+    bool_t rtt_valid;   /* have we taken a sample yet? */
+    long srtt;
+    long rttvar;
+    long rto;
+
+    //fast retransmit / NewReno fast recovery (RFC 6582)
+    int dupacks;            /* duplicate acks seen for unacked_sequence_num */
+    bool_t in_recovery;
+    tcp_seq recover;        /* current_sequence_num when recovery started */
+
+    //scoreboard totals over rtx_queue, so the pipe is cheap to work out
+    uint32_t sacked_bytes;  /* sacked but not yet cumulatively acked */
+    uint32_t lost_bytes;    /* marked lost and not resent since */
+
+    cc_state_t cc;
+
+    //timers, on a wheel of TIMER_TICK_US ticks.  wait_until is where
+    //next_deadline() puts the earliest of them for stcp_wait_for_event()
+    timer_wheel_t timers;
+    stcp_timer_t rtx_timer;         /* running while rtx_count > 0 */
+    stcp_timer_t delack_timer;
+    stcp_timer_t keepalive_timer;
+    stcp_timer_t pace_timer;        /* running while pacing holds data back */
+    stcp_timer_t persist_timer;     /* running while the peer's window is shut */
+    struct timespec wait_until;
+
+    //pacing: data segments leave no faster than pacing_rate(), give or
+    //take a burst
+    uint64_t pace_next_us;  /* clock_us() the next one may leave at */
+
+    int persist_backoff;    /* window probes sent into the current zero window */
+
+    //keepalives (RFC 1122 4.2.3.6), off unless MYSO_KEEPALIVE asks
+    long keepalive_us;      /* idle time before the first probe */
+    int keepalive_probes;   /* sent since we last heard from the peer */
+    uint64_t last_heard_us; /* clock_us() at the last segment from the peer */
+
+    //segment sizing (RFC 879, RFC 6691)
+    int local_mss;          /* the most the network under us delivers, which we advertise */
+    int mss;                /* payload limit for what we send, after the peer's say */
+    char *packet;           /* one packet's worth of scratch, local_mss and headers */
+    stcp_buf_t *rx_buf;     /* what the segment being processed arrived in */
+    size_t packet_len;
+
+    //Nagle's algorithm (RFC 896) and corking
+    bool_t nodelay;         /* MYSO_NODELAY, small segments go out regardless */
+    size_t app_low_water;   /* what we last told stcp_app_set_low_water() */
 
     // used only in close loop smiley
-    int fin_ack;
+    bool_t app_closed;      /* myclose() has been called */
+    bool_t fin_received;    /* peer's FIN has arrived in order */
+    bool_t fin_pending;     /* a FIN arrived ahead of a hole... */
+    tcp_seq fin_seq;        /* ...and this is where it sits */
+    bool_t fin_acked;       /* peer has acked our FIN */
 } context_t;
 
 static void send_syn(mysocket_t sd, context_t *ctx);
@@ -165,26 +441,98 @@ static void recv_syn_send_synack(mysocket_t sd, context_t *ctx);
 static void recv_synack_send_ack(mysocket_t sd, context_t *ctx);
 static void recv_ack(mysocket_t sd, context_t *ctx);
 
-static State get_next_state(context_t *ctx, int event);
-static State execute_state(context_t *ctx, int event);
+static void maid_active(mysocket_t sd, context_t *ctx);
+static void maid_passive(mysocket_t sd, context_t *ctx);
+static void close_fork(mysocket_t sd, context_t *ctx);
+static void close_wait(mysocket_t sd, context_t *ctx);
+static void wait_fin(mysocket_t sd, context_t *ctx);
+static void wait_ackfin(mysocket_t sd, context_t *ctx);
+
+static const struct transition *next_transition(const context_t *ctx);
+static void take_transition(mysocket_t sd, context_t *ctx, const struct transition *t);
+
+static uint32_t advertised_window(context_t *ctx);
+static uint16_t window_field(context_t *ctx, uint8_t flags);
+static void get_time(struct timespec *ts);
+static uint64_t clock_us(void);
+static void arm_timer(context_t *ctx, stcp_timer_t *timer, long delay_us);
+static void arm_timer_at(context_t *ctx, stcp_timer_t *timer, uint64_t when_us);
+static long elapsed_us(const struct timespec *from, const struct timespec *to);
+static void init_timers(mysocket_t sd, context_t *ctx);
+static void rtt_sample(context_t *ctx, long rtt);
 
 static void generate_initial_seq_num(context_t *ctx, bool_t is_active);
+static void init_buffers(mysocket_t sd, context_t *ctx);
 static void control_loop(mysocket_t sd, context_t *ctx);
 
 
-// this is probably broken, but it needs to be defined in the global scope
-std::map<std::pair<State, State>, std::function<void(mysocket_t, context_t*)>> fxn_map = {
+typedef void (*transition_fn)(mysocket_t sd, context_t *ctx);
+
+typedef struct transition {
+    State next;             /* ERROR where the event means nothing here */
+    transition_fn action;   /* run on the way to next, NULL for none */
+} transition_t;
+
+typedef struct {
+    State state;            /* the row's own index, checked below */
+    transition_t on[NUM_EVENTS];
+} state_row_t;
 
-        //fxn associated with the start-up. 
-    {{CLOSED, CONNECT}, send_syn},
-    {{LISTEN, ACCEPT}, recv_syn_send_synack},
-    {{CONNECT, ACTIVE_ESTABLISHED}, recv_synack_send_ack}, //
-    {{ACCEPT, PASSIVE_ESTABLISHED}, recv_ack}, 
+#define NO_TRANSITION { ERROR, NULL }
 
-        //fxn associated with the establishment. 
-    // idfk how to do this bit Will or Pascal yall are gonna have to handle this
+/* the connection's state machine, one row per state and one column per
+ * event.  data and acks are handled by service_events(); this only says
+ * what happens once the handshake steps or the FIN flags change.
+ */
+static constexpr state_row_t fsm[NUM_STATES] = {
+    //              EV_STEP                                     EV_FIN_RECEIVED                 EV_FIN_ACKED                EV_APP_CLOSE
+    { LISTEN,               { { ACCEPT, recv_syn_send_synack },         NO_TRANSITION,                  NO_TRANSITION,              NO_TRANSITION } },
+    { CLOSED,               { { CONNECT, send_syn },                    NO_TRANSITION,                  NO_TRANSITION,              NO_TRANSITION } },
+    { CONNECT,              { { ACTIVE_ESTABLISHED, recv_synack_send_ack }, NO_TRANSITION,              NO_TRANSITION,              NO_TRANSITION } },
+    { ACCEPT,               { { PASSIVE_ESTABLISHED, recv_ack },        NO_TRANSITION,                  NO_TRANSITION,              NO_TRANSITION } },
+    { ACTIVE_PRECLOSE,      { { FIN_WAIT_1, maid_active },              NO_TRANSITION,                  NO_TRANSITION,              NO_TRANSITION } },
+    { PASSIVE_PRECLOSE,     { { CLOSE_WAIT, close_wait },               NO_TRANSITION,                  NO_TRANSITION,              NO_TRANSITION } },
+    { PASSIVE_ESTABLISHED,  { NO_TRANSITION,                            { PASSIVE_PRECLOSE, NULL },     NO_TRANSITION,              { ACTIVE_PRECLOSE, NULL } } },
+    { ACTIVE_ESTABLISHED,   { NO_TRANSITION,                            { PASSIVE_PRECLOSE, NULL },     NO_TRANSITION,              { ACTIVE_PRECLOSE, NULL } } },
+    { FIN_WAIT_1,           { NO_TRANSITION,                            { CLOSING, close_fork },        { FIN_WAIT_2, close_fork }, NO_TRANSITION } },
+    { FIN_WAIT_2,           { NO_TRANSITION,                            { CLOSED, wait_fin },           NO_TRANSITION,              NO_TRANSITION } },
+    { CLOSE_WAIT,           { NO_TRANSITION,                            NO_TRANSITION,                  NO_TRANSITION,              { LAST_CALL, maid_passive } } },
+    { LAST_CALL,            { NO_TRANSITION,                            NO_TRANSITION,                  { CLOSED, wait_ackfin },    NO_TRANSITION } },
+    { CLOSING,              { NO_TRANSITION,                            NO_TRANSITION,                  { CLOSED, wait_ackfin },    NO_TRANSITION } },
+    { ERROR,                { NO_TRANSITION,                            NO_TRANSITION,                  NO_TRANSITION,              NO_TRANSITION } },
+    { ERROR_REFUSED,        { NO_TRANSITION,                            NO_TRANSITION,                  NO_TRANSITION,              NO_TRANSITION } },
+    { ERROR_ABORTED,        { NO_TRANSITION,                            NO_TRANSITION,                  NO_TRANSITION,              NO_TRANSITION } },
 };
 
+//the error states are where the machine stops; everything else needs a way out
+static constexpr bool fsm_terminal(int state){
+    return state == ERROR || state == ERROR_REFUSED || state == ERROR_ABORTED;
+}
+
+static constexpr bool fsm_has_exit(int state, int ev){
+    return ev < NUM_EVENTS && (fsm[state].on[ev].next != ERROR || fsm_has_exit(state, ev + 1));
+}
+
+//every transition leads to some other real state
+static constexpr bool fsm_targets_ok(int state, int ev){
+    return ev == NUM_EVENTS ||
+           ((fsm[state].on[ev].next == ERROR ||
+             (fsm[state].on[ev].next >= 0 && fsm[state].on[ev].next < NUM_STATES &&
+              fsm[state].on[ev].next != state)) &&
+            fsm_targets_ok(state, ev + 1));
+}
+
+static constexpr bool fsm_complete(int state){
+    return state == NUM_STATES ||
+           (fsm[state].state == state &&
+            (fsm_terminal(state) || fsm_has_exit(state, 0)) &&
+            fsm_targets_ok(state, 0) &&
+            fsm_complete(state + 1));
+}
+
+static_assert(sizeof(fsm) / sizeof(fsm[0]) == NUM_STATES, "fsm needs a row for every state");
+static_assert(fsm_complete(0), "fsm rows out of order, a live state with no way out, or a bad target");
+
 /* initialise the transport layer, and start the main loop, handling
  * any data from the peer or the application.  this function should not
  * return until the connection is closed.
@@ -192,15 +540,21 @@ std::map<std::pair<State, State>, std::function<void(mysocket_t, context_t*)>> f
 void transport_init(mysocket_t sd, bool_t is_active)
 {
 
-    #if HANDSHAKE_PRINT
-        std::cout << "IN TRANSPORT_INIT" << std::endl;
-    #endif
     context_t *ctx;
 
+    stcp_log_init();
+    LOG_DEBUG("sd %d: transport starting, %s open", sd, is_active ? "active" : "passive");
+
     ctx = (context_t *) calloc(1, sizeof(context_t));
     assert(ctx);
 
+    ctx->sd = sd;
     generate_initial_seq_num(ctx, is_active);
+    ctx->rto = RTO_INITIAL_US;
+    ctx->delack_us = MAX(stcp_get_option(sd, MYSO_DELACK), 0) * 1000L;
+    ctx->nodelay = stcp_get_option(sd, MYSO_NODELAY) > 0;
+    init_buffers(sd, ctx);
+    init_timers(sd, ctx);
 
     /* XXX: you should send a SYN packet here if is_active, or wait for one
      * to arrive if !is_active.  after the handshake completes, unblock the
@@ -219,27 +573,28 @@ void transport_init(mysocket_t sd, bool_t is_active)
     //do the part of the fsm for handshaking
     while(ctx->state != PASSIVE_ESTABLISHED && ctx->state != ACTIVE_ESTABLISHED){
 
-#if HANDSHAKE_LOOP_PRINT
-    std::cout << "IN HANDSHAKE LOOP" << std::endl;
-#endif
+        LOG_TRACE("sd %d: handshake in state %d", sd, ctx->state);
 
-        State next_state = get_next_state(ctx, 0);
+        const transition_t *t = next_transition(ctx);
 
-        if(next_state == ERROR){
+        if(t == NULL){
 
             //not sure exactly what should be done here
             exit(1);
         } 
 
-        //execute the event; 
-        fxn_map[{ctx->state, next_state}](sd, ctx);
-
-        //advance the state
-        ctx->state = next_state;
+        //execute the event and advance the state
+        take_transition(sd, ctx, t);
     }
 
     if (ctx->state != ERROR) {
         // end state: connection has been established, handshake is done.
+        //the windows are counted in segments the size the SYNs settled on
+        cc_init(&ctx->cc, stcp_get_option(sd, MYSO_CONGESTION), ctx->mss);
+        ctx->last_heard_us = clock_us();
+        if(ctx->keepalive_us > 0){
+            arm_timer(ctx, &ctx->keepalive_timer, ctx->keepalive_us);
+        }
         stcp_unblock_application(sd);
         control_loop(sd, ctx);
     }
@@ -252,10 +607,56 @@ void transport_init(mysocket_t sd, bool_t is_active)
     }
 
     /* do any cleanup here */
+    ringDestroy(&ctx->current_buffer);
+    ringDestroy(&ctx->opposite_buffer);
+    free(ctx->rtx_queue);
+    free(ctx->packet);
     free(ctx);
 }
 
 
+/* sizes the send and receive buffers from MYSO_SNDBUF/MYSO_RCVBUF, or
+ * starts them small for autotuning, and picks the window scale that lets
+ * us advertise the biggest receive buffer we might grow to.
+ */
+static void init_buffers(mysocket_t sd, context_t *ctx)
+{
+    int sndbuf = stcp_get_option(sd, MYSO_SNDBUF);
+    int rcvbuf = stcp_get_option(sd, MYSO_RCVBUF);
+
+    ctx->sndbuf_auto = sndbuf <= 0;
+    ctx->rcvbuf_auto = rcvbuf <= 0;
+    ctx->sndbuf_max = ctx->sndbuf_auto ? BUF_AUTOTUNE_MAX : sndbuf;
+    ctx->rcvbuf_max = ctx->rcvbuf_auto ? BUF_AUTOTUNE_MAX : rcvbuf;
+
+    //the rings round their sizes up to a power of two
+    ringInit(&ctx->current_buffer, ctx->sndbuf_auto ? BUF_INITIAL : sndbuf);
+    ringInit(&ctx->opposite_buffer, ctx->rcvbuf_auto ? BUF_INITIAL : rcvbuf);
+    ctx->sndbuf_max = MAX(ctx->sndbuf_max, (int) ringCapacity(&ctx->current_buffer));
+    ctx->rcvbuf_max = MAX(ctx->rcvbuf_max, (int) ringCapacity(&ctx->opposite_buffer));
+
+    ctx->rtx_cap = RTX_QUEUE_LEN;
+    ctx->rtx_queue = (segment_t *) calloc(ctx->rtx_cap, sizeof(segment_t));
+    assert(ctx->rtx_queue);
+
+    ctx->rcv_wscale = 0;
+    while(ctx->rcv_wscale < TCP_MAX_WINSHIFT && (ctx->rcvbuf_max >> ctx->rcv_wscale) > 0xffff){
+        ctx->rcv_wscale++;
+    }
+    get_time(&ctx->rcv_space_stamp);
+
+    //we advertise whatever still fits a packet once the header and the
+    //most options we could be sent are taken off, and assume the
+    //classic 536 until the peer's SYN says otherwise
+    ctx->packet_len = stcp_network_max_packet(sd);
+    ctx->local_mss = (int) ctx->packet_len - (int) sizeof(STCPHeader) - TCP_MAX_OPTIONS_LEN;
+    assert(ctx->local_mss > 0);
+    ctx->mss = MIN(STCP_MSS, ctx->local_mss);
+    stcp_app_set_mss(sd, ctx->mss);
+    ctx->packet = (char *) malloc(ctx->packet_len);
+    assert(ctx->packet);
+}
+
 /* generate random initial sequence number for an STCP connection */
 static void generate_initial_seq_num(context_t *ctx, bool_t is_active)
 {
@@ -272,152 +673,356 @@ static void generate_initial_seq_num(context_t *ctx, bool_t is_active)
     ctx->current_sequence_num = ctx->initial_sequence_num;
 }
 
-State get_next_state(context_t *ctx, int event) {
+//whether ev has happened, as far as the connection can tell
+static bool event_pending(const context_t *ctx, Event ev){
+    switch(ev){
+        case EV_STEP:           return true;
+        case EV_FIN_RECEIVED:   return ctx->fin_received;
+        case EV_FIN_ACKED:      return ctx->fin_acked;
+        case EV_APP_CLOSE:      return ctx->app_closed;
+        default:                return false;
+    }
+}
+
+//the first pending event the current state reacts to, or NULL to stay put
+static const transition_t *next_transition(const context_t *ctx){
+    const transition_t *on = fsm[ctx->state].on;
 
-    switch (ctx->state) {
-        case CLOSED:
-            switch(event){
-                // should be refused on connection & aborted on accept, otherwise idfk how this would fail
-                default: return CONNECT; 
-            }
+    for(int ev = 0;ev < NUM_EVENTS;ev++){
+        if(on[ev].next != ERROR && event_pending(ctx, (Event) ev)){
+            return &on[ev];
+        }
+    }
+    return NULL;
+}
+
+static void take_transition(mysocket_t sd, context_t *ctx, const transition_t *t){
+    if(t->action){
+        t->action(sd, ctx);
+    }
+    ctx->state = t->next;
+}
+
+/* the clock we stamp segments with.  it ticks every millisecond, inside
+ * the 1ms to 1s RFC 7323 asks for, so it takes 24.8 days to get halfway
+ * round and PAWS can order any two stamps ts_recent_valid() lets it
+ * compare.  that's too coarse to time a LAN by, so RTTs come from the send
+ * times in the retransmission queue, with an echo saying which send of a
+ * resent segment got there.
+ */
+static uint32_t ts_stamp(const struct timespec *ts){
+    return (uint32_t)(ts->tv_sec * 1000ULL + ts->tv_nsec / 1000000);
+}
+
+static uint32_t ts_now(void){
+    struct timespec ts;
+    get_time(&ts);
+    return ts_stamp(&ts);
+}
+
+//an echo of ts_now() as an RTT sample in microseconds, or -1 for none
+static long ts_echo_rtt(uint32_t tsecr){
+    uint32_t ticks = ts_now() - tsecr;
+
+    if(tsecr == 0 || ticks > RTO_MAX_US / 1000){
+        return -1;  //none, or from further back than anything we'd wait for
+    }
+    return (long) MAX(ticks, 1u) * 1000L;
+}
+
+static void ts_set_recent(context_t *ctx, uint32_t tsval){
+    ctx->ts_recent = tsval;
+    ctx->ts_recent_us = clock_us();
+}
+
+/* once the peer has been quiet for 24 days its clock may have gone more
+ * than halfway round since ts_recent, which then says nothing about what
+ * it sends next (RFC 7323 5.5)
+ */
+static bool ts_recent_valid(context_t *ctx){
+    return clock_us() - ctx->ts_recent_us < TS_RECENT_IDLE_US;
+}
+
+//PAWS: stamped before something we already took, so an old duplicate
+static bool paws_reject(context_t *ctx, uint32_t tsval){
+    return (int32_t)(tsval - ctx->ts_recent) < 0 && ts_recent_valid(ctx);
+}
+
+/* reads the options off a received packet of len bytes.  anything we don't
+ * know is skipped, and a malformed option ends the parse.
+ */
+static void parse_options(const char *packet, int len, tcp_options_t *opts){
+    const uint8_t *p = (const uint8_t *) packet;
+
+    memset(opts, 0, sizeof(tcp_options_t));
+    if(len < (int)sizeof(STCPHeader)){
+        return;
+    }
+
+    int end = MIN((int)TCP_DATA_START(packet), len);
+    int i = sizeof(STCPHeader);
+    while(i < end){
+        if(p[i] == TCPOPT_EOL){
             break;
-        case LISTEN:
-            switch(event){
-                default: return ACCEPT;
-            }
+        }
+        if(p[i] == TCPOPT_NOP){
+            i++;
+            continue;
+        }
+        if(i + 1 >= end || p[i + 1] < 2 || i + p[i + 1] > end){
             break;
-        case CONNECT: 
-            switch(event){
-                default: return ACTIVE_ESTABLISHED;
-            }
-        case ACCEPT: 
-            switch(event){
-                default: return PASSIVE_ESTABLISHED;
-            }
+        }
 
-        // this shit is probably not good but this is how i *think* we're meant to do it
-        case ACTIVE_ESTABLISHED:
-            switch(event){
-                case APP_CLOSE_REQUESTED: return FIN_WAIT_1;
-                default: return ACTIVE_ESTABLISHED;
-            }
-        case PASSIVE_ESTABLISHED:
-            switch(event){
-                default: return PASSIVE_ESTABLISHED;
-            }        
-        case ACTIVE_PRECLOSE:
-            return FIN_WAIT_1;
-        case PASSIVE_PRECLOSE:
-            return CLOSE_WAIT;
-        case FIN_WAIT_1:
-            // irrelevant
-            return FIN_WAIT_1;
-        case FIN_WAIT_2:
-            switch(event){
-                case NETWORK_DATA: return CLOSED; // should be okay because it'll only loop if not done, and we can set done to true.
-                default: return FIN_WAIT_2;
-            }
-        case CLOSE_WAIT:
-            switch(event){
-                case NETWORK_DATA: return LAST_CALL;
-                default: return CLOSE_WAIT;
-            }
-        case LAST_CALL:
-            switch(event){
-                // idfk this is probably wrong
-                default: return CLOSED;
-            }
-        default:
-            return ERROR;
+        int opt_len = p[i + 1];
+        switch(p[i]){
+            case TCPOPT_MAXSEG:
+                if(opt_len == TCPOLEN_MAXSEG){
+                    uint16_t mss;
+                    memcpy(&mss, &p[i + 2], sizeof(mss));
+                    opts->mss_present = TRUE;
+                    opts->mss = ntohs(mss);
+                }
+                break;
+            case TCPOPT_SACK_PERMITTED:
+                opts->sack_permitted = opt_len == TCPOLEN_SACK_PERMITTED;
+                break;
+            case TCPOPT_TIMESTAMP:
+                if(opt_len == TCPOLEN_TIMESTAMP){
+                    uint32_t stamps[2];
+                    memcpy(stamps, &p[i + 2], sizeof(stamps));
+                    opts->ts_present = TRUE;
+                    opts->tsval = ntohl(stamps[0]);
+                    opts->tsecr = ntohl(stamps[1]);
+                }
+                break;
+            case TCPOPT_WINDOW:
+                if(opt_len == TCPOLEN_WINDOW){
+                    opts->wscale_present = TRUE;
+                    opts->wscale = MIN(p[i + 2], TCP_MAX_WINSHIFT);
+                }
+                break;
+            case TCPOPT_SACK:
+                for(int off = 2;off + TCPOLEN_SACK_BLOCK <= opt_len && opts->sack_count < MAX_SACK_BLOCKS;off += TCPOLEN_SACK_BLOCK){
+                    uint32_t edges[2];
+                    memcpy(edges, &p[i + off], sizeof(edges));
+                    opts->sack[opts->sack_count].start = ntohl(edges[0]);
+                    opts->sack[opts->sack_count].end = ntohl(edges[1]);
+                    opts->sack_count++;
+                }
+                break;
+            default:
+                break;
+        }
+        i += opt_len;
+    }
+}
+
+//writes one SACK block, edges in network order
+static int put_sack_block(uint8_t *out, const seq_range_t *r){
+    uint32_t edges[2] = { htonl(r->start), htonl(r->end) };
+    memcpy(out, edges, sizeof(edges));
+    return TCPOLEN_SACK_BLOCK;
+}
+
+/* describes what we hold past the hole as SACK blocks.  the run holding the
+ * latest arrival goes first (RFC 2018), then the rest from the top down,
+ * since those are the ones the sender is least likely to have heard about.
+ */
+static int build_sack_blocks(context_t *ctx, uint8_t *out, int room){
+    int blocks = MIN(MIN(ctx->ooo_count, MAX_SACK_BLOCKS), (room - 4) / TCPOLEN_SACK_BLOCK);
+    int first = ctx->ooo_count - 1;
+    int len = 4;
+
+    for(int i = 0;i<ctx->ooo_count;i++){
+        if(SEQ_LEQ(ctx->ooo_ranges[i].start, ctx->last_ooo_seq) &&
+           SEQ_LT(ctx->last_ooo_seq, ctx->ooo_ranges[i].end)){
+            first = i;
+            break;
+        }
+    }
+
+    out[0] = TCPOPT_NOP;
+    out[1] = TCPOPT_NOP;
+    out[2] = TCPOPT_SACK;
+    out[3] = 2 + blocks * TCPOLEN_SACK_BLOCK;
+
+    len += put_sack_block(&out[len], &ctx->ooo_ranges[first]);
+    for(int i = ctx->ooo_count - 1;i>=0 && len < 4 + blocks * TCPOLEN_SACK_BLOCK;i--){
+        if(i != first){
+            len += put_sack_block(&out[len], &ctx->ooo_ranges[i]);
+        }
+    }
+    return len;
+}
+
+/* fills in the options for an outgoing segment with the given flags and
+ * returns their length, always a multiple of four.
+ */
+static int build_options(context_t *ctx, uint8_t flags, uint8_t *out){
+    int len = 0;
+
+    //every SYN says how big a segment we can take
+    if(flags & TH_SYN){
+        uint16_t mss = htons((uint16_t) MIN(ctx->local_mss, 0xffff));
+        out[len++] = TCPOPT_MAXSEG;
+        out[len++] = TCPOLEN_MAXSEG;
+        memcpy(&out[len], &mss, sizeof(mss));
+        len += sizeof(mss);
+    }
+
+    //window scaling is offered on our SYN and only returned if the peer offered it
+    if((flags & TH_SYN) && (!(flags & TH_ACK) || ctx->wscale_ok)){
+        out[len++] = TCPOPT_NOP;
+        out[len++] = TCPOPT_WINDOW;
+        out[len++] = TCPOLEN_WINDOW;
+        out[len++] = (uint8_t) ctx->rcv_wscale;
     }
+
+    //timestamps are offered the same way, then go on every segment
+    if(((flags & TH_SYN) && !(flags & TH_ACK)) || ctx->ts_ok){
+        uint32_t stamps[2] = { htonl(ts_now()), htonl(ctx->ts_recent) };
+        out[len++] = TCPOPT_NOP;
+        out[len++] = TCPOPT_NOP;
+        out[len++] = TCPOPT_TIMESTAMP;
+        out[len++] = TCPOLEN_TIMESTAMP;
+        memcpy(&out[len], stamps, sizeof(stamps));
+        len += sizeof(stamps);
+    }
+
+    //offer SACK on our SYN, and accept it on the SYN-ACK if the peer did
+    if((flags & TH_SYN) && (!(flags & TH_ACK) || ctx->sack_permitted)){
+        out[len++] = TCPOPT_NOP;
+        out[len++] = TCPOPT_NOP;
+        out[len++] = TCPOPT_SACK_PERMITTED;
+        out[len++] = TCPOLEN_SACK_PERMITTED;
+    }
+
+    if((flags & TH_ACK) && ctx->sack_permitted && ctx->ooo_count > 0){
+        len += build_sack_blocks(ctx, &out[len], TCP_MAX_OPTIONS_LEN - len);
+    }
+
+    assert(len % sizeof(uint32_t) == 0 && len <= TCP_MAX_OPTIONS_LEN);
+    return len;
+}
+
+/* anything we send carries the latest ack, so nothing is owed any more.
+ * the window is taken from the header rather than worked out again, since
+ * the app may have read more in the meantime.
+ */
+static void ack_sent(context_t *ctx, const STCPHeader *hdr){
+    if(ctx->ack_pending){
+        tw_cancel(&ctx->timers, &ctx->delack_timer);
+    }
+    ctx->ack_pending = FALSE;
+    ctx->ack_now = FALSE;
+    ctx->delack_bytes = 0;
+    ctx->last_adv_window = (uint32_t) hdr->th_win << ((hdr->th_flags & TH_SYN) ? 0 : ctx->rcv_wscale);
+    ctx->last_ack_sent = ctx->opposite_current_sequence_num;
 }
 
 static void send_just_header(mysocket_t sd, context_t *ctx, uint8_t current_flags){
     
-    #if HANDSHAKE_PRINT
-    std::cout << "SEND HEAD" << std::endl;
-    #endif
-
-    STCPHeader* send_header = new STCPHeader();
+    STCPHeader header;
+    STCPHeader* send_header = &header;
     memset(send_header, 0, sizeof(STCPHeader));
 
-    //if SYN then you send your initial sequence number
+    //if SYN then you send your initial sequence number, otherwise it's the
+    //next one we'll use (PAWS looks at it even when there's no data)
+    send_header->th_seq=ctx->current_sequence_num;
     if(current_flags & TH_SYN){
-
-        #if HANDSHAKE_PRINT
-        std::cout << "      INIT SEQ#: " << ctx->current_sequence_num << std::endl;
-        #endif
-
-        send_header->th_seq=ctx->current_sequence_num;
+        get_time(&ctx->syn_sent_at);
     }
 
     //if ACK you send the next bit of data you expect to recv
     if(current_flags & TH_ACK){
         send_header->th_ack = ctx->opposite_current_sequence_num;
-        
-        #if HANDSHAKE_PRINT
-        std::cout << "      INIT ACK#: " << send_header->th_ack << std::endl;
-        #endif
     }
 
-    send_header->th_win=getSize(&ctx->current_buffer);
+    uint8_t opts[TCP_MAX_OPTIONS_LEN];
+    int opts_len = build_options(ctx, current_flags, opts);
+
+    send_header->th_win=window_field(ctx, current_flags);
     send_header->th_flags=current_flags;
-    send_header->th_off = 5; 
+    send_header->th_off = (sizeof(STCPHeader) + opts_len) / sizeof(uint32_t);
+
+    LOG_DEBUG("sd %d: send header, flags 0x%02x seq %u ack %u", sd,
+              current_flags, send_header->th_seq, send_header->th_ack);
 
-    stcp_network_send(sd, send_header, sizeof(STCPHeader), NULL);
+    stcp_network_send(sd, send_header, sizeof(STCPHeader), opts, (size_t) opts_len, NULL);
 
-    delete send_header;
+    if(current_flags & TH_ACK){
+        ack_sent(ctx, send_header);
+    }
 }
 
 static void recv_just_header(mysocket_t sd, context_t *ctx, uint8_t current_flags){
 
-    #if HANDSHAKE_PRINT
-    std::cout << "RECV HEAD" << std::endl;
-    #endif
-
-    STCPHeader* recv_header = new STCPHeader();
-    
-    memset(recv_header, 0, sizeof(STCPHeader));
+    char packet[sizeof(STCPHeader) + TCP_MAX_OPTIONS_LEN];
+    STCPHeader* recv_header = (STCPHeader *) packet;
+    tcp_options_t opts;
     
-    stcp_network_recv(sd, recv_header, sizeof(STCPHeader));
+    //read the options too, or they'd be left behind as a packet of their own
+    int num_read = stcp_network_recv(sd, packet, sizeof(packet));
+    if(num_read < (int)sizeof(STCPHeader)){
+        memset(packet + MAX(num_read, 0), 0, sizeof(STCPHeader) - MAX(num_read, 0));
+    }
+    parse_options(packet, num_read, &opts);
     
     if((recv_header->th_flags & current_flags) != current_flags){
         // error handling?
+        LOG_WARN("sd %d: handshake wanted flags 0x%02x, got 0x%02x", sd,
+                 current_flags, recv_header->th_flags);
         ctx->state = ERROR;
         return;
     }
 
-    #if HANDSHAKE_PRINT
-    std::cout << "      RECV FLAGS CORRECT" << std::endl;
-    #endif
+    LOG_DEBUG("sd %d: recv header, flags 0x%02x seq %u ack %u", sd,
+              recv_header->th_flags, recv_header->th_seq, recv_header->th_ack);
 
     //if SYN then you track the opposite seq number
     if(recv_header->th_flags & TH_SYN){
         
         ctx->opposite_current_sequence_num = recv_header->th_seq;
+        ctx->sack_permitted = opts.sack_permitted;
 
-        #if HANDSHAKE_PRINT
-        std::cout << "      OPP INIT SEQ#: " << ctx->opposite_current_sequence_num << std::endl;
-        #endif
-    }
+        //a peer that doesn't say gets the default (RFC 9293 3.7.1)
+        ctx->mss = MIN(ctx->local_mss, opts.mss_present ? opts.mss : STCP_MSS);
+        ctx->mss = MAX(ctx->mss, 1);
+        stcp_app_set_mss(sd, ctx->mss);
 
-    //TODO: CHNAGE FOR PIPELINE. 
-    if(recv_header->th_flags & TH_ACK){
+        ctx->ts_ok = opts.ts_present;
+        ts_set_recent(ctx, opts.tsval);
 
-        #if HANDSHAKE_PRINT
-        std::cout << "      OPP INIT ACK#: " << recv_header->th_ack << std::endl;
-        #endif
+        //scaling only happens if both SYNs carried the option
+        ctx->wscale_ok = opts.wscale_present;
+        ctx->snd_wscale = opts.wscale_present ? opts.wscale : 0;
+        if(!ctx->wscale_ok){
+            ctx->rcv_wscale = 0;
+        }
+    }
 
+    if(recv_header->th_flags & TH_ACK){
         if(recv_header->th_ack != ctx->current_sequence_num + 1){
             //dopped packed
+            LOG_WARN("sd %d: handshake acks %u, expected %u", sd,
+                     recv_header->th_ack, ctx->current_sequence_num + 1);
             ctx->state = ERROR;
             return;
         }
+
+        //the handshake gives both ends a first RTT sample, which the
+        //receive buffer autotuning needs before any data is acked
+        struct timespec now;
+        get_time(&now);
+        rtt_sample(ctx, elapsed_us(&ctx->syn_sent_at, &now));
     }
     
     ctx->tcp_opposite_window_size = recv_header->th_win;
-
-    delete recv_header;
+    if(!(recv_header->th_flags & TH_SYN)){
+        ctx->tcp_opposite_window_size <<= ctx->snd_wscale;
+    }
+    ctx->snd_wl1 = recv_header->th_seq;
+    ctx->snd_wl2 = recv_header->th_ack;
 }
 
 static void send_syn(mysocket_t sd, context_t *ctx){
@@ -452,193 +1057,1264 @@ static void recv_ack(mysocket_t sd, context_t *ctx){
     ctx->current_sequence_num++;
 }
 
-static void recv_sumthin_from_network(mysocket_t sd, context_t *ctx){
-    #if ESTABLISHED_PRINT
-    std::cout << "RECV FROM NET" << std::endl;
-    #endif
+/* timekeeping for RTT samples and the timers.  it's all on CLOCK_MONOTONIC,
+ * which is also what stcp_wait_for_event() wants its abstime on, so setting
+ * the system clock can't fire a timer early or hold one up.
+ */
+static void get_time(struct timespec *ts){
+    clock_gettime(CLOCK_MONOTONIC, ts);
+}
 
-    //stores the header and raw data in separate files
-    STCPHeader* recv_header = new STCPHeader(); //to store the header after we copy data in
-    char* recv_buffer = new char[sizeof(STCPHeader) + STCP_MSS]; //to receive the entire packet
-    
-    //reads in the data from the network
-    int num_read = stcp_network_recv(sd, recv_buffer, sizeof(STCPHeader) + STCP_MSS); //receive from network the entire packet]
-    
-    int amt_head = (size_t)TCP_DATA_START(recv_buffer);
-    int amt_data = num_read - amt_head;
+static uint64_t clock_us(void){
+    struct timespec ts;
+    get_time(&ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
 
-    //reads the data into the header
-    memcpy(recv_header,recv_buffer, amt_head); //copy the packet head into the struct which analyzes it
-    ctx->fin_ack = 2;
-    //analyze struct
-    if(recv_header->th_flags&TH_ACK) { 
-        ctx->fin_ack = 1;
-        #if ESTABLISHED_PRINT
-        std::cout << "      RECV ACK" << std::endl;
-        std::cout << "      ACK#:" << recv_header->th_ack << std::endl;
-        #endif
-
-        //TODO: not sure if this works
-        //then record how much data has been received by the other
-        slideWindow(&ctx->current_buffer,recv_header->th_ack-ctx->current_sequence_num);
-        //and record it in the sequence num
-        
-        //no the seq_number are adjusted when stuff is sent. 
-        // ctx->current_sequence_num=recv_header->th_ack;
-
-    } else if(recv_header->th_flags&TH_FIN) { 
-        ctx->fin_ack = 1;
-        #if ESTABLISHED_PRINT
-        std::cout << "      RECV FIN" << std::endl;
-        #endif
-        ctx->state = PASSIVE_PRECLOSE;
-        // ctx->state=PASSIVE_PRECLOSE; /////////////////////////////////////////////////////// change for fsm, evelyn
-    } else { //otherwise access the data part of the packet
-        
-        #if ESTABLISHED_PRINT
-        std::cout << "      RECV DATA" << std::endl;
-        std::cout << "      RECV SEQ NUMBER (MATCH OPP): " << recv_header->th_seq << std::endl;
-        //prints everything but the end of line character
-        std::cout << "      DATA: " << std::string(&recv_buffer[amt_head]).substr(0, amt_data - 2) << std::endl;
-        std::cout << "      AMT: " << amt_data << std::endl;
-        #endif
-        
-        //TODO: PASCAL FIGURE THIS OUT
-        insertWindow(&ctx->opposite_buffer,recv_buffer); //record that data was given to us
-        
-        //increments the opposite sequence number for the ack
-        ctx->opposite_current_sequence_num += amt_data; //record the sequence number
-        
-        //send an ack
-        send_just_header(sd,ctx,TH_ACK); 
+//(re)starts a timer to go off at when_us, rounded up to the next tick
+static void arm_timer_at(context_t *ctx, stcp_timer_t *timer, uint64_t when_us){
+    tw_arm(&ctx->timers, timer, (when_us + TIMER_TICK_US - 1) / TIMER_TICK_US);
+}
+
+static void arm_timer(context_t *ctx, stcp_timer_t *timer, long delay_us){
+    arm_timer_at(ctx, timer, clock_us() + delay_us);
+}
+
+static long elapsed_us(const struct timespec *from, const struct timespec *to){
+    return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000L;
+}
+
+/* how much of the receive buffer we can offer the peer.  in-order data
+ * goes straight up to the app, so the buffer is opposite_buffer's size, less
+ * whatever of it the app has still to read.  once the app has closed
+ * nothing is going to read it, so it's discarded rather than left to shut
+ * the window for good.
+ */
+static uint32_t advertised_window(context_t *ctx){
+    uint32_t size = ringCapacity(&ctx->opposite_buffer);
+    size_t unread = ctx->app_closed ? 0 : stcp_app_unread(ctx->sd);
+    return unread >= size ? 0 : size - (uint32_t) unread;
+}
 
-        //send the data to client
-        stcp_app_send(sd, &recv_buffer[amt_head], amt_data); 
+//what the peer was last told it may send past opposite_current_sequence_num
+static uint32_t offered_window(context_t *ctx){
+    int offered = (int)(ctx->last_ack_sent + ctx->last_adv_window - ctx->opposite_current_sequence_num);
+    return (uint32_t) MAX(offered, 0);
+}
 
-        //TODO: PASCAL FIGURE THIS OUT
-        slideWindow(&ctx->opposite_buffer,num_read); //record that data was sent up
+//the window as it goes in th_win: unscaled on a SYN, scaled after that
+static uint16_t window_field(context_t *ctx, uint8_t flags){
+    uint32_t window = advertised_window(ctx);
+    if(!(flags & TH_SYN)){
+        window >>= ctx->rcv_wscale;
     }
-    delete recv_header;
+    return (uint16_t) MIN(window, 0xffff);
 }
 
-static void recv_sumthin_from_app(mysocket_t sd, context_t *ctx){
-    
-    #if ESTABLISHED_PRINT
-    std::cout << "RECV FROM APP" << std::endl;
-    #endif
-    
-    //NEED TO CHECK THE RECV HAS ENOUGH ROOM IN BUFFER
+/* bytes we think are still in the network (the RFC 6675 pipe): everything
+ * outstanding, less what the peer has sacked and what we've written off as
+ * lost but not yet resent.
+ */
+static uint32_t bytes_in_flight(context_t *ctx){
+    uint32_t outstanding = ctx->current_sequence_num - ctx->unacked_sequence_num;
+    return outstanding - ctx->sacked_bytes - ctx->lost_bytes;
+}
 
-    char* recv_buffer = new char[STCP_MSS]; //temp recv buffer
+//room the congestion window leaves, which is all resends need
+static int cwnd_room(context_t *ctx){
+    return (int) cc_cwnd(&ctx->cc) - (int) bytes_in_flight(ctx);
+}
 
-    //receive the data from the app
-    size_t num_read = stcp_app_recv(sd, (void*)recv_buffer, STCP_MSS);
+/* bytes of new data we may still put on the wire before either window is
+ * full.  the peer's window counts from snd_una whatever it has sacked.
+ */
+static int usable_window(context_t *ctx){
+    int outstanding = (int)(ctx->current_sequence_num - ctx->unacked_sequence_num);
+    return MIN(cwnd_room(ctx), ctx->tcp_opposite_window_size - outstanding);
+}
 
-    #if ESTABLISHED_PRINT
-    //print but no end line or carriage returns
-    std::cout << "      RECV: " << std::string(recv_buffer, num_read).substr(0, num_read) << std::endl;
-    #endif
-    
-    #if ESTABLISHED_PRINT
-    std::cout << "      CURRENT SEQ NUM:" << ctx->current_sequence_num << std::endl;
-    #endif
+/* bytes per second to pace at: the congestion controller's rate if it
+ * keeps one, otherwise a window per round trip with some headroom, so
+ * pacing spreads the window out rather than holding it back.  0, until
+ * there's an RTT to go on, means don't pace.
+ */
+static uint64_t pacing_rate(context_t *ctx){
+    uint64_t rate = ctx->cc.ops->pacing_rate(&ctx->cc);
 
-    STCPHeader* send_header = new STCPHeader();
-    memset(send_header, 0, sizeof(STCPHeader));
+    if(rate == 0 && ctx->rtt_valid && ctx->srtt > 0){
+        int gain = cc_cwnd(&ctx->cc) < ctx->cc.ssthresh ? PACING_SS_GAIN : PACING_CA_GAIN;
+        rate = (uint64_t) cc_cwnd(&ctx->cc) * 1000000ULL * gain / 100 / (uint64_t) ctx->srtt;
+    }
+    return rate;
+}
 
-    send_header->th_win = (uint16_t) getSize(&ctx->current_buffer);
-    send_header->th_flags = 0;
-    send_header->th_seq=ctx->current_sequence_num;
-    send_header->th_off = 5; 
+/* charges a segment of len bytes to the pacing schedule.  credit saved up
+ * while quiet is capped at a burst, so a connection coming off an idle
+ * spell or an ack covering a lot doesn't put its whole window out at once.
+ * the pace timer can't wake us more often than once a tick, so a burst is
+ * at least a tick's worth or we'd fall behind the rate.
+ */
+static void pace_segment(context_t *ctx, int len){
+    uint64_t rate = pacing_rate(ctx);
 
-    stcp_network_send(sd, (void*)send_header, sizeof(STCPHeader), (void*)recv_buffer, num_read, NULL);
+    if(rate == 0){
+        ctx->pace_next_us = 0;
+        return;
+    }
+    uint64_t now = clock_us();
+    uint64_t burst = MAX((uint64_t) PACING_BURST_SEGS * ctx->mss, rate * TIMER_TICK_US / 1000000ULL);
+    uint64_t burst_us = burst * 1000000ULL / rate;
+    uint64_t start = MAX(ctx->pace_next_us, now > burst_us ? now - burst_us : 0);
 
-    delete send_header;
+    ctx->pace_next_us = start + (uint64_t) len * 1000000ULL / rate;
+}
 
-    //advances our seq number
-    ctx->current_sequence_num += ctx->current_sequence_num+num_read;
+//whether pacing lets a segment go now.  if not, the pace timer is set
+//for when it will, and the rate the acks show meanwhile is the pacer's
+//own, which the congestion controller mustn't mistake for the path's
+static bool pacing_allows(context_t *ctx){
+    if(ctx->pace_next_us <= clock_us()){
+        return true;
+    }
+    if(!tw_pending(&ctx->pace_timer)){
+        arm_timer_at(ctx, &ctx->pace_timer, ctx->pace_next_us);
+    }
+    ctx->cc.send_limited = true;
+    return false;
 }
 
+static bool can_send_data(context_t *ctx){
+    //resends go first
+    return ctx->lost_bytes == 0 &&
+        usable_window(ctx) > 0 && ringSpace(&ctx->current_buffer) > 0 &&
+        pacing_allows(ctx);
+}
 
-/* control_loop() is the main STCP loop; it repeatedly waits for one of the
- * following to happen:
- *   - incoming data from the peer
- *   - new data from the application (via mywrite())
- *   - the socket to be closed (via myclose())
- *   - a timeout
- */
-static void control_loop(mysocket_t sd, context_t *ctx)
-{
-    assert(ctx);
-    assert(!ctx->done);
+static segment_t *rtx_at(context_t *ctx, int i){
+    return &ctx->rtx_queue[(ctx->rtx_start + i) & (ctx->rtx_cap - 1)];
+}
 
-    unsigned int event; 
-  
-    #if ESTABLISHED_PRINT
-    std::cout << "HANDSHAKE COMPLETE!" << std::endl;
-    std::cout << "SEQ NUM: " << ctx->current_sequence_num << std::endl;
-    std::cout << "OPP SEQ NUM: " << ctx->opposite_current_sequence_num << std::endl;
-    #endif
+static segment_t *rtx_oldest(context_t *ctx){
+    return rtx_at(ctx, 0);
+}
 
+//lost, and not resent since we decided so
+static bool awaiting_resend(const segment_t *seg){
+    return seg->lost && !seg->resent && !seg->sacked;
+}
 
-    // ESTABLISHED state
-    while (ctx->state == PASSIVE_ESTABLISHED || ctx->state == ACTIVE_ESTABLISHED)
-    {
-        event = stcp_wait_for_event(sd, ANY_EVENT, NULL);
+static void mark_sacked(context_t *ctx, segment_t *seg){
+    if(seg->sacked){
+        return;
+    }
+    if(awaiting_resend(seg)){
+        ctx->lost_bytes -= SEG_SEQ_LEN(seg);
+    }
+    seg->sacked = TRUE;
+    ctx->sacked_bytes += SEG_SEQ_LEN(seg);
+}
 
-        if(event & APP_DATA){
-            recv_sumthin_from_app(sd, ctx);
-        } else if (event & NETWORK_DATA){
-            recv_sumthin_from_network(sd, ctx);
-        } else if (event & APP_CLOSE_REQUESTED) {
-            ctx->state = ACTIVE_PRECLOSE;
+//marks seg for resending, even if it has already been resent once
+static void mark_lost(context_t *ctx, segment_t *seg){
+    if(seg->sacked || awaiting_resend(seg)){
+        return;
+    }
+    seg->lost = TRUE;
+    seg->resent = FALSE;
+    ctx->lost_bytes += SEG_SEQ_LEN(seg);
+}
+
+static segment_t *rtx_push(context_t *ctx){
+    if(ctx->rtx_count == ctx->rtx_cap){
+        //unwrap into a queue twice the size
+        segment_t *bigger = (segment_t *) malloc(2 * ctx->rtx_cap * sizeof(segment_t));
+        assert(bigger);
+        for(int i = 0;i<ctx->rtx_count;i++){
+            bigger[i] = *rtx_at(ctx, i);
         }
+        free(ctx->rtx_queue);
+        ctx->rtx_queue = bigger;
+        ctx->rtx_cap *= 2;
+        ctx->rtx_start = 0;
     }
-    while (!ctx->done) {
-        event = stcp_wait_for_event(sd, ANY_EVENT, NULL);
-        State next_state = get_next_state(ctx, event);
-        
-        //execute the event; 
-        fxn_map[{ctx->state, next_state}](sd, ctx);
+    segment_t *seg = rtx_at(ctx, ctx->rtx_count);
+    memset(seg, 0, sizeof(*seg));
+    ctx->rtx_count++;
+    return seg;
+}
 
-        //advance the state
-        // if statement is b/c FIN_WAIT_1's function will set its own state based on the next packet it receives :)
-        if (ctx->state != FIN_WAIT_2 && ctx->state != CLOSING && ctx->state != PASSIVE_PRECLOSE) ctx->state = next_state;
+static void rtx_pop(context_t *ctx){
+    assert(ctx->rtx_count > 0);
+    segment_t *seg = rtx_oldest(ctx);
+    if(seg->sacked){
+        ctx->sacked_bytes -= SEG_SEQ_LEN(seg);
+    } else if(awaiting_resend(seg)){
+        ctx->lost_bytes -= SEG_SEQ_LEN(seg);
     }
+    ctx->rtx_start = (ctx->rtx_start + 1) & (ctx->rtx_cap - 1);
+    ctx->rtx_count--;
 }
 
-static void maid_active(mysocket_t sd, context_t *ctx) {
-    // sends a fin packet. we're not waiting for it to close because that's fin_wait_1's problem
-    send_just_header(sd, ctx, TH_FIN);
+static void arm_rtx_timer(context_t *ctx){
+    arm_timer(ctx, &ctx->rtx_timer, ctx->rto);
 }
-static void maid_passive(mysocket_t sd, context_t *ctx) {
-    // send EOF
-    send_just_header(sd, ctx, TH_FIN);
+
+/* folds one round-trip measurement into SRTT/RTTVAR and recomputes the
+ * RTO as in RFC 6298 section 2.  a fresh sample also undoes any backoff.
+ */
+static void rtt_sample(context_t *ctx, long rtt){
+    if(rtt < 0){
+        return;
+    }
+    if(!ctx->rtt_valid){
+        ctx->srtt = rtt;
+        ctx->rttvar = rtt / 2;
+        ctx->rtt_valid = TRUE;
+    } else {
+        long err = ctx->srtt - rtt;
+        if(err < 0){
+            err = -err;
+        }
+        ctx->rttvar = (3 * ctx->rttvar + err) / 4;
+        ctx->srtt = (7 * ctx->srtt + rtt) / 8;
+    }
+    ctx->rto = ctx->srtt + MAX(CLOCK_GRANULARITY_US, 4 * ctx->rttvar);
+    ctx->rto = MIN(MAX(ctx->rto, RTO_MIN_US), RTO_MAX_US);
 }
 
-static void close_fork(mysocket_t sd, context_t *ctx) {
-    recv_sumthin_from_network(sd, ctx);
-    // fin has been received before ack of fin, enter CLOSING
-    if (ctx->fin_ack == 1) { 
-        ctx->state = CLOSING;
-        stcp_fin_received(sd);
-    } 
-    // ack received, enter FIN_WAIT_2
-    else 
-        ctx->state = FIN_WAIT_2;
+/* (re)sends a segment from the retransmission queue.  the payload sits in
+ * current_buffer until the peer acks it, and goes to the network layer
+ * straight from there, in two pieces if it wraps.
+ */
+static void send_segment(mysocket_t sd, context_t *ctx, segment_t *seg){
+    struct iovec payload[2];
+    uint8_t opts[TCP_MAX_OPTIONS_LEN];
+    STCPHeader send_header;
+
+    memset(&send_header, 0, sizeof(STCPHeader));
+    send_header.th_seq = seg->seq;
+    send_header.th_ack = ctx->opposite_current_sequence_num;
+    send_header.th_flags = seg->flags | TH_ACK;
+    send_header.th_win = window_field(ctx, send_header.th_flags);
+
+    //before the timestamp goes in, so the stamp is never from later on
+    get_time(&seg->sent_at);
+    int opts_len = build_options(ctx, send_header.th_flags, opts);
+    send_header.th_off = (sizeof(STCPHeader) + opts_len) / sizeof(uint32_t);
+
+    uint32_t offset = seg->seq - ctx->unacked_sequence_num;
+    assert(offset + seg->len <= ringUsed(&ctx->current_buffer));
+    ringReadable(&ctx->current_buffer, offset, seg->len, payload);
+
+    pace_segment(ctx, seg->len);
+    stcp_network_send(sd, &send_header, sizeof(STCPHeader), opts, (size_t) opts_len,
+                      payload[0].iov_base, payload[0].iov_len,
+                      payload[1].iov_base, payload[1].iov_len, NULL);
+    ack_sent(ctx, &send_header);
 }
-static void wait_fin(mysocket_t sd, context_t *ctx) {
-    recv_sumthin_from_network(sd, ctx);
-    if (ctx->fin_ack != 1) { // something has terribly gone wrong
-        perror("????? error in FIN_WAIT_2 section");
-    } else {
-        stcp_fin_received(sd);
+
+//queues a segment for retransmission and puts it on the wire
+static void send_new_segment(mysocket_t sd, context_t *ctx, int len, uint8_t flags){
+    segment_t *seg = rtx_push(ctx);
+    seg->seq = ctx->current_sequence_num;
+    seg->len = len;
+    seg->flags = flags;
+
+    ctx->current_sequence_num += SEG_SEQ_LEN(seg);
+
+    //the timer tracks the oldest segment, so only start it if it's idle
+    if(ctx->rtx_count == 1){
+        arm_rtx_timer(ctx);
     }
+    send_segment(sd, ctx, seg);
+}
+
+/* releases everything the peer has cumulatively acked and restarts the
+ * timer for whatever is still outstanding.  tsecr is the ack's timestamp
+ * echo, 0 for none.
+ */
+static void release_acked(context_t *ctx, tcp_seq ack, uint32_t tsecr){
+    struct timespec now;
+    long rtt = -1;
+    uint32_t in_flight = bytes_in_flight(ctx);
+
+    get_time(&now);
+    while(ctx->rtx_count > 0){
+        segment_t *seg = rtx_oldest(ctx);
+        if(SEQ_GT(seg->seq + SEG_SEQ_LEN(seg), ack)){
+            break;
+        }
+        //Karn: an ack for something we resent is ambiguous, don't time it,
+        //unless the echo says it's for the latest send
+        if(seg->retransmits == 0 ||
+           (tsecr != 0 && (int32_t)(tsecr - ts_stamp(&seg->sent_at)) >= 0)){
+            rtt = elapsed_us(&seg->sent_at, &now);
+        }
+        if(seg->flags & TH_FIN){
+            ctx->fin_acked = TRUE;
+        }
+        rtx_pop(ctx);
+    }
+    //an echo of an earlier send can still be timed, if only to the tick
+    if(rtt < 0){
+        rtt = ts_echo_rtt(tsecr);
+    }
+    rtt_sample(ctx, rtt);
+
+    //a receiver short on room may have kept only the front of a segment
+    if(ctx->rtx_count > 0 && SEQ_GT(ack, rtx_oldest(ctx)->seq)){
+        segment_t *seg = rtx_oldest(ctx);
+        int trim = (int)(ack - seg->seq);
+
+        if(seg->sacked){
+            ctx->sacked_bytes -= trim;
+        } else if(awaiting_resend(seg)){
+            ctx->lost_bytes -= trim;
+        }
+        seg->seq = ack;
+        seg->len -= trim;
+    }
+
+    //the FIN doesn't live in the buffer, so don't slide past the data
+    int acked = (int)(ack - ctx->unacked_sequence_num);
+    ringConsume(&ctx->current_buffer, MIN((uint32_t) acked, ringUsed(&ctx->current_buffer)));
+    ctx->unacked_sequence_num = ack;
+
+    ctx->cc.ops->on_ack(&ctx->cc, acked, in_flight, rtt, ctx->in_recovery, &now);
+
+    if(ctx->rtx_count > 0){
+        arm_rtx_timer(ctx);
+    } else {
+        tw_cancel(&ctx->timers, &ctx->rtx_timer);
+    }
+}
+
+//puts a segment marked lost back on the wire
+static void resend_segment(mysocket_t sd, context_t *ctx, segment_t *seg){
+    if(awaiting_resend(seg)){
+        ctx->lost_bytes -= SEG_SEQ_LEN(seg);
+    }
+    seg->resent = TRUE;
+    seg->retransmits++;
+    send_segment(sd, ctx, seg);
+}
+
+//resends the oldest unacked segment without waiting for the timer
+static void fast_retransmit(mysocket_t sd, context_t *ctx){
+    segment_t *seg = rtx_oldest(ctx);
+
+    LOG_DEBUG("sd %d: fast retransmit seq %u", sd, seg->seq);
+
+    if(!seg->lost){
+        mark_lost(ctx, seg);
+    }
+    resend_segment(sd, ctx, seg);
+    arm_rtx_timer(ctx);
+}
+
+/* marks every segment the peer's SACK blocks cover.  blocks that reach
+ * outside what's outstanding are stale or bogus and get ignored.
+ */
+static void apply_sack(context_t *ctx, const tcp_options_t *opts){
+    for(int b = 0;b<opts->sack_count;b++){
+        const seq_range_t *r = &opts->sack[b];
+
+        if(!SEQ_LT(r->start, r->end) || SEQ_LT(r->start, ctx->unacked_sequence_num) ||
+           SEQ_GT(r->end, ctx->current_sequence_num)){
+            continue;
+        }
+        for(int i = 0;i<ctx->rtx_count;i++){
+            segment_t *seg = rtx_at(ctx, i);
+            if(SEQ_GEQ(seg->seq, r->end)){
+                break;
+            }
+            if(SEQ_GEQ(seg->seq, r->start) && SEQ_LEQ(seg->seq + SEG_SEQ_LEN(seg), r->end)){
+                mark_sacked(ctx, seg);
+            }
+        }
+    }
+}
+
+/* RFC 6675 loss detection: a hole with DUPACK_THRESHOLD sacked segments
+ * above it is lost rather than reordered.  returns true if it marked any.
+ */
+static bool sack_detect_losses(context_t *ctx){
+    int sacked_above = 0;
+    bool marked = false;
+
+    for(int i = ctx->rtx_count - 1;i>=0;i--){
+        segment_t *seg = rtx_at(ctx, i);
+        if(seg->sacked){
+            sacked_above++;
+        } else if(sacked_above >= DUPACK_THRESHOLD && !seg->lost){
+            mark_lost(ctx, seg);
+            marked = true;
+        }
+    }
+    return marked;
+}
+
+/* handles the ack field of an incoming segment: new data acked, or a
+ * duplicate ack hinting that something was lost.  three duplicates trigger
+ * a fast retransmit and NewReno recovery, where every partial ack resends
+ * the next hole straight away until everything sent before the loss is in.
+ * with SACK the scoreboard also finds the holes further up, and
+ * send_pending() fills them as the pipe drains, so a window with several
+ * losses recovers in about one round trip.
+ */
+static void process_ack(mysocket_t sd, context_t *ctx, STCPHeader *hdr,
+                        const tcp_options_t *opts, int amt_data){
+    tcp_seq ack = hdr->th_ack;
+    int window = (int) hdr->th_win << ctx->snd_wscale;
+    bool window_changed = window != ctx->tcp_opposite_window_size;
+    bool advanced = false;
+    bool dupack = false;
+
+    if(SEQ_GT(ack, ctx->current_sequence_num)){
+        //acks something we never sent
+        return;
+    }
+
+    //only a segment newer than the one the window last came from may
+    //change it, so an old or reordered ack can't shrink or reopen it
+    //(RFC 793 SND.WL1/SND.WL2)
+    if(SEQ_GEQ(ack, ctx->unacked_sequence_num) &&
+       (SEQ_GT(hdr->th_seq, ctx->snd_wl1) ||
+        (hdr->th_seq == ctx->snd_wl1 && SEQ_GEQ(ack, ctx->snd_wl2)))){
+        ctx->tcp_opposite_window_size = window;
+        ctx->snd_wl1 = hdr->th_seq;
+        ctx->snd_wl2 = ack;
+    } else {
+        window_changed = false;
+    }
+
+    if(SEQ_GT(ack, ctx->unacked_sequence_num)){
+        ctx->dupacks = 0;
+        //a timestamp echo says exactly which transmission is being acked,
+        //so it can be timed even if it was a resend
+        release_acked(ctx, ack, ctx->ts_ok && opts->ts_present ? opts->tsecr : 0);
+        advanced = true;
+    } else if(ack == ctx->unacked_sequence_num && ctx->rtx_count > 0 && amt_data == 0 &&
+              !(hdr->th_flags & (TH_SYN|TH_FIN)) && !window_changed){
+        //only a bare ack for the oldest hole with nothing else going on counts
+        ctx->dupacks++;
+        dupack = true;
+    }
+
+    bool sack_loss = false;
+    if(ctx->sack_permitted && opts->sack_count > 0){
+        apply_sack(ctx, opts);
+        sack_loss = ctx->sacked_bytes > 0 && sack_detect_losses(ctx);
+    }
+
+    if(!ctx->in_recovery){
+        if(ctx->rtx_count > 0 && ((dupack && ctx->dupacks == DUPACK_THRESHOLD) || sack_loss)){
+            struct timespec now;
+
+            get_time(&now);
+            ctx->cc.ops->on_loss(&ctx->cc, bytes_in_flight(ctx), &now);
+            ctx->in_recovery = TRUE;
+            ctx->recover = ctx->current_sequence_num;
+            fast_retransmit(sd, ctx);
+        }
+        return;
+    }
+
+    if(advanced && SEQ_GEQ(ack, ctx->recover)){
+        //full ack, everything outstanding at the loss has arrived
+        ctx->in_recovery = FALSE;
+        ctx->cc.ops->on_recovered(&ctx->cc);
+    } else if(advanced && ctx->rtx_count > 0 && !rtx_oldest(ctx)->lost){
+        //partial ack, the next hole is right behind it
+        fast_retransmit(sd, ctx);
+    } else if(dupack && !ctx->sack_permitted){
+        //another segment has left the network.  with SACK the pipe already
+        //knows, so the window doesn't need inflating
+        ctx->cc.ops->on_dupack(&ctx->cc);
+    }
+}
+
+/* resends the segments marked lost, oldest first, as far as the congestion
+ * window allows.  after a timeout that's everything outstanding (slow start
+ * from snd_una); in SACK recovery it's only the holes.
+ */
+static void send_pending(mysocket_t sd, context_t *ctx){
+    for(int i = 0;i<ctx->rtx_count && ctx->lost_bytes > 0 && cwnd_room(ctx) > 0 && pacing_allows(ctx);i++){
+        segment_t *seg = rtx_at(ctx, i);
+        if(awaiting_resend(seg)){
+            resend_segment(sd, ctx, seg);
+        }
+    }
+}
+
+//the retransmission timer has run out, so resend from the oldest segment
+static void rtx_timeout(stcp_timer_t *timer, void *arg){
+    context_t *ctx = (context_t *) arg;
+    mysocket_t sd = ctx->sd;
+
+    if(ctx->done || ctx->rtx_count == 0){
+        return;
+    }
+
+    segment_t *seg = rtx_oldest(ctx);
+    if(seg->retransmits >= MAX_RETRANSMITS){
+        //peer has gone away, give up on the connection
+        LOG_WARN("sd %d: no ack for seq %u after %d retransmits, aborting", sd, seg->seq, seg->retransmits);
+        errno = ECONNABORTED;
+        ctx->done = TRUE;
+        return;
+    }
+
+    LOG_DEBUG("sd %d: timeout, retransmit seq %u rto %ldus", sd, seg->seq, ctx->rto);
+
+    ctx->cc.ops->on_rto(&ctx->cc, bytes_in_flight(ctx));
+
+    //a timeout ends any fast recovery; everything outstanding the peer
+    //hasn't sacked is presumed lost and goes again, starting with the oldest
+    ctx->in_recovery = FALSE;
+    ctx->dupacks = 0;
+    for(int i = 0;i<ctx->rtx_count;i++){
+        mark_lost(ctx, rtx_at(ctx, i));
+    }
+    send_pending(sd, ctx);
+
+    //back off until an unambiguous sample brings the RTO back down
+    ctx->rto = MIN(ctx->rto * 2, RTO_MAX_US);
+    arm_rtx_timer(ctx);
+}
+
+/* records [start, end) as held out of order, merging it with any runs it
+ * touches.  returns false if there's no room to track another run.
+ */
+static bool ooo_add_range(context_t *ctx, tcp_seq start, tcp_seq end){
+    int i = 0;
+
+    //skip the runs entirely before this one
+    while(i < ctx->ooo_count && SEQ_LT(ctx->ooo_ranges[i].end, start)){
+        i++;
+    }
+
+    if(i == ctx->ooo_count || SEQ_LT(end, ctx->ooo_ranges[i].start)){
+        //doesn't touch anything, slot it in
+        if(ctx->ooo_count == MAX_OOO_RANGES){
+            return false;
+        }
+        memmove(&ctx->ooo_ranges[i + 1], &ctx->ooo_ranges[i],
+                (ctx->ooo_count - i) * sizeof(seq_range_t));
+        ctx->ooo_ranges[i].start = start;
+        ctx->ooo_ranges[i].end = end;
+        ctx->ooo_count++;
+        return true;
+    }
+
+    //overlaps or abuts run i; widen it and swallow any runs it now reaches
+    seq_range_t *r = &ctx->ooo_ranges[i];
+    if(SEQ_LT(start, r->start)){
+        r->start = start;
+    }
+    if(SEQ_GT(end, r->end)){
+        r->end = end;
+    }
+    int j = i + 1;
+    while(j < ctx->ooo_count && SEQ_LEQ(ctx->ooo_ranges[j].start, r->end)){
+        if(SEQ_GT(ctx->ooo_ranges[j].end, r->end)){
+            r->end = ctx->ooo_ranges[j].end;
+        }
+        j++;
+    }
+    memmove(&ctx->ooo_ranges[i + 1], &ctx->ooo_ranges[j],
+            (ctx->ooo_count - j) * sizeof(seq_range_t));
+    ctx->ooo_count -= j - i - 1;
+    return true;
+}
+
+/* hands the app everything that's now contiguous with
+ * opposite_current_sequence_num, pulling it out of the reassembly buffer.
+ * returns the number of bytes delivered.
+ */
+static int deliver_in_order(mysocket_t sd, context_t *ctx){
+    int delivered = 0;
+
+    while(ctx->ooo_count > 0 && SEQ_LEQ(ctx->ooo_ranges[0].start, ctx->opposite_current_sequence_num)){
+        seq_range_t *r = &ctx->ooo_ranges[0];
+
+        if(SEQ_GT(r->end, ctx->opposite_current_sequence_num)){
+            struct iovec run[2];
+            uint32_t len = r->end - ctx->opposite_current_sequence_num;
+            int pieces = ringReadable(&ctx->opposite_buffer, 0, len, run);
+
+            for(int i = 0;i<pieces;i++){
+                stcp_app_send(sd, run[i].iov_base, run[i].iov_len);
+            }
+            ringConsume(&ctx->opposite_buffer, len);
+            ctx->opposite_current_sequence_num += len;
+            delivered += len;
+        }
+
+        ctx->ooo_count--;
+        memmove(&ctx->ooo_ranges[0], &ctx->ooo_ranges[1], ctx->ooo_count * sizeof(seq_range_t));
+    }
+    return delivered;
+}
+
+/* receive buffer autotuning, roughly Linux's dynamic right-sizing: once a
+ * round trip, if the app was handed more than half the buffer, the sender
+ * could have used a bigger window, so double what it got.
+ */
+static void tune_rcvbuf(context_t *ctx, int delivered){
+    struct timespec now;
+
+    if(!ctx->rcvbuf_auto || !ctx->rtt_valid){
+        return;
+    }
+    ctx->rcv_space_bytes += delivered;
+
+    get_time(&now);
+    if(elapsed_us(&ctx->rcv_space_stamp, &now) < ctx->srtt){
+        return;
+    }
+    uint32_t size = ringCapacity(&ctx->opposite_buffer);
+    if(2 * (uint32_t) ctx->rcv_space_bytes > size && size < (uint32_t) ctx->rcvbuf_max){
+        ringGrow(&ctx->opposite_buffer, 2 * size);
+    }
+    ctx->rcv_space_bytes = 0;
+    ctx->rcv_space_stamp = now;
+}
+
+//the send buffer just has to keep up with the congestion window
+static void tune_sndbuf(context_t *ctx){
+    if(!ctx->sndbuf_auto){
+        return;
+    }
+    uint32_t want = MIN(2 * cc_cwnd(&ctx->cc), (uint32_t) ctx->sndbuf_max);
+    if(want > ringCapacity(&ctx->current_buffer)){
+        ringGrow(&ctx->current_buffer, want);
+    }
+}
+
+/* takes the payload of a data segment: in-order bytes go straight up to the
+ * app, still in the buffer they arrived in (along with anything queued
+ * behind them, which is copied out of opposite_buffer), bytes past a hole are
+ * parked in opposite_buffer until the hole fills.  returns true if the
+ * segment was the next one we were waiting for.
+ */
+static bool recv_data(mysocket_t sd, context_t *ctx, tcp_seq seq, const char *data, int len){
+    tcp_seq next = ctx->opposite_current_sequence_num;
+
+    if(ctx->fin_received){
+        return false;
+    }
+
+    //trim anything we already have off the front
+    if(SEQ_LT(seq, next)){
+        int dup = (int)(next - seq);
+        if(dup >= len){
+            return false;
+        }
+        seq += dup;
+        data += dup;
+        len -= dup;
+    }
+
+    //and anything that doesn't fit the window off the back.  the app
+    //reading less than it's sent can shrink the window a little when it's
+    //rounded to the scale, but what we've already offered we still take
+    int offset = (int)(seq - next);
+    int window = (int) MAX(advertised_window(ctx), offered_window(ctx));
+    if(offset + len > window){
+        len = window - offset;
+        if(len <= 0){
+            return false;
+        }
+    }
+
+    if(offset == 0){
+        stcp_app_send_buf(sd, ctx->rx_buf, data, len);
+        ringConsume(&ctx->opposite_buffer, len);
+        ctx->opposite_current_sequence_num += len;
+        tune_rcvbuf(ctx, len + deliver_in_order(sd, ctx));
+        return true;
+    }
+
+    if(ooo_add_range(ctx, seq, seq + len)){
+        ringWriteAt(&ctx->opposite_buffer, offset, data, len);
+        ctx->last_ooo_seq = seq;
+    }
+    return false;
+}
+
+/* two full segments, or half the window once segments are too big for two
+ * of them to fit
+ */
+static int delack_limit(context_t *ctx){
+    return (int) MIN(2 * (uint32_t) ctx->mss, ringCapacity(&ctx->opposite_buffer) / 2);
+}
+
+/* we owe the peer an ack.  it goes out once the segments queued up with
+ * this one are handled if asked to, if delayed acks are off, or once
+ * delack_limit() bytes are waiting on it; otherwise it waits up to
+ * delack_us in the hope of riding along with data.
+ */
+static void schedule_ack(mysocket_t sd, context_t *ctx, bool now){
+    if(now || ctx->delack_us == 0 || ctx->delack_bytes >= delack_limit(ctx)){
+        ctx->ack_now = TRUE;
+        return;
+    }
+    if(!ctx->ack_pending){
+        ctx->ack_pending = TRUE;
+        arm_timer(ctx, &ctx->delack_timer, ctx->delack_us);
+    }
+}
+
+//sends the ack a batch of segments left owing, unless data took it along
+static void flush_ack(mysocket_t sd, context_t *ctx){
+    if(ctx->ack_now){
+        send_just_header(sd,ctx,TH_ACK);
+    }
+}
+
+//a held back ack has waited long enough
+static void delack_timeout(stcp_timer_t *timer, void *arg){
+    context_t *ctx = (context_t *) arg;
+
+    if(!ctx->done && ctx->ack_pending){
+        send_just_header(ctx->sd,ctx,TH_ACK);
+    }
+}
+
+/* a bare ack one behind what we've sent.  the peer has had that sequence
+ * number already, so all it can do is ack it, with its current window.
+ */
+static void send_probe(context_t *ctx){
+    ctx->current_sequence_num--;
+    send_just_header(ctx->sd,ctx,TH_ACK);
+    ctx->current_sequence_num++;
+}
+
+/* tells the peer the window has opened, once that's worth an ack of its
+ * own: the peer thinks it's down to half the buffer or less, and the
+ * window has at least doubled and grown by a segment, or half the buffer
+ * if that's less (RFC 1122 4.2.3.3).  a delayed ack goes early once the
+ * buffer has grown enough.  until then, APP_DRAINED wakes us when the app
+ * has read enough for the window to get there.
+ */
+static void check_window_update(mysocket_t sd, context_t *ctx){
+    uint32_t size = ringCapacity(&ctx->opposite_buffer);
+    uint32_t window = advertised_window(ctx);
+    uint32_t offered = offered_window(ctx);
+
+    if(ctx->ack_pending && window >= ctx->last_adv_window + delack_limit(ctx)){
+        send_just_header(sd,ctx,TH_ACK);
+        return;
+    }
+    if(ctx->fin_received || offered > size / 2){
+        return;
+    }
+    uint32_t want = MAX(2 * offered, offered + MIN((uint32_t) ctx->mss, size / 2));
+    if(window >= want){
+        LOG_DEBUG("sd %d: window update, %u -> %u", sd, offered, window);
+        send_just_header(sd,ctx,TH_ACK);
+    } else if(!ctx->drain_mark_set){
+        stcp_app_set_drain_mark(sd, size - want);
+        ctx->drain_mark_set = TRUE;
+    }
+}
+
+/* whether we have something to send that only the peer's window is
+ * holding back: nothing in flight to bring an ack, and data the app has
+ * written still queued.  a FIN goes out whatever the window, and the app's
+ * close only reaches us once its data has, so that covers a pending FIN too.
+ */
+static bool stalled_on_window(context_t *ctx){
+    return ctx->tcp_opposite_window_size == 0 && ctx->rtx_count == 0 &&
+        !ctx->fin_acked && stcp_app_pending(ctx->sd) > 0;
+}
+
+/* the peer's window is shut with nothing in flight, so no ack is coming to
+ * tell us when it opens, and the update it sends could be lost.  keep
+ * asking, backing off like the retransmission timer but never giving up
+ * (RFC 1122 4.2.2.17).
+ */
+static void persist_timeout(stcp_timer_t *timer, void *arg){
+    context_t *ctx = (context_t *) arg;
+
+    if(ctx->done || !stalled_on_window(ctx)){
+        return;
+    }
+    LOG_DEBUG("sd %d: window probe %d", ctx->sd, ctx->persist_backoff + 1);
+    send_probe(ctx);
+    ctx->persist_backoff = MIN(ctx->persist_backoff + 1, 30);
+    arm_timer(ctx, timer, MIN(ctx->rto << ctx->persist_backoff, (long) RTO_MAX_US));
+}
+
+//runs the persist timer while data waits on the peer's shut window, and
+//stops it once the window opens or there's nothing left to send
+static void check_persist(context_t *ctx){
+    if(stalled_on_window(ctx)){
+        if(!tw_pending(&ctx->persist_timer)){
+            arm_timer(ctx, &ctx->persist_timer, MIN(ctx->rto << ctx->persist_backoff, (long) RTO_MAX_US));
+        }
+    } else if(tw_pending(&ctx->persist_timer) || ctx->persist_backoff > 0){
+        tw_cancel(&ctx->timers, &ctx->persist_timer);
+        ctx->persist_backoff = 0;
+    }
+}
+
+/* the connection has been idle for keepalive_us, or a probe has gone
+ * unanswered (RFC 1122 4.2.3.6).  while data is outstanding the
+ * retransmission timer is already asking.
+ */
+static void keepalive_timeout(stcp_timer_t *timer, void *arg){
+    context_t *ctx = (context_t *) arg;
+    long idle = (long)(clock_us() - ctx->last_heard_us);
+    long interval = MIN(KEEPALIVE_INTERVAL_US, ctx->keepalive_us);
+
+    if(ctx->done){
+        return;
+    }
+    if(ctx->keepalive_probes == 0 && (idle < ctx->keepalive_us || ctx->rtx_count > 0)){
+        arm_timer(ctx, timer, MAX(ctx->keepalive_us - idle, interval));
+        return;
+    }
+    if(ctx->keepalive_probes >= KEEPALIVE_PROBES){
+        LOG_WARN("sd %d: no answer to %d keepalives, aborting", ctx->sd, ctx->keepalive_probes);
+        errno = ETIMEDOUT;
+        ctx->done = TRUE;
+        return;
+    }
+
+    LOG_DEBUG("sd %d: idle %ldms, keepalive probe %d", ctx->sd, idle / 1000, ctx->keepalive_probes + 1);
+
+    send_probe(ctx);
+    ctx->keepalive_probes++;
+    arm_timer(ctx, timer, interval);
+}
+
+//pacing held data back and now it can go; the loop sees that for itself
+static void pace_timeout(stcp_timer_t *timer, void *arg){
+}
+
+//the peer has been heard from, so it's alive and any probing can stop
+static void peer_heard(context_t *ctx){
+    ctx->last_heard_us = clock_us();
+    ctx->keepalive_probes = 0;
+}
+
+static void init_timers(mysocket_t sd, context_t *ctx){
+    tw_init(&ctx->timers, clock_us() / TIMER_TICK_US);
+    tw_timer_init(&ctx->rtx_timer, rtx_timeout, ctx);
+    tw_timer_init(&ctx->delack_timer, delack_timeout, ctx);
+    tw_timer_init(&ctx->keepalive_timer, keepalive_timeout, ctx);
+    tw_timer_init(&ctx->pace_timer, pace_timeout, ctx);
+    tw_timer_init(&ctx->persist_timer, persist_timeout, ctx);
+    ctx->keepalive_us = MAX(stcp_get_option(sd, MYSO_KEEPALIVE), 0) * 1000000L;
+}
+
+//runs whatever timers are due by now
+static void run_timers(context_t *ctx){
+    tw_advance(&ctx->timers, clock_us() / TIMER_TICK_US);
+}
+
+//the earliest timer we have running, or NULL to wait indefinitely
+static const struct timespec *next_deadline(context_t *ctx){
+    uint64_t due;
+
+    if(!tw_next_expiry(&ctx->timers, &due)){
+        return NULL;
+    }
+    due *= TIMER_TICK_US;
+    ctx->wait_until.tv_sec = (time_t)(due / 1000000ULL);
+    ctx->wait_until.tv_nsec = (long)(due % 1000000ULL) * 1000L;
+    return &ctx->wait_until;
+}
+
+/* Van Jacobson's header prediction.  in a bulk transfer nearly every
+ * segment is either the next run of in-order data or a bare ack moving
+ * snd_una along, with nothing else going on: no flags, no window change,
+ * no options past a timestamp, no loss being repaired.  those are handled
+ * here without the general path's option parsing and branching.  returns
+ * false to leave the segment to the general path.
+ */
+static bool predicted_segment(mysocket_t sd, context_t *ctx, const char *packet, int len){
+    static const uint8_t ts_head[4] = { TCPOPT_NOP, TCPOPT_NOP, TCPOPT_TIMESTAMP, TCPOLEN_TIMESTAMP };
+    const STCPHeader *hdr = (const STCPHeader *) packet;
+    int amt_head = (int) TCP_DATA_START(packet);
+    int amt_data = len - amt_head;
+    uint32_t stamps[2];
+
+    if((hdr->th_flags & ~TH_PUSH) != TH_ACK ||
+       hdr->th_seq != ctx->opposite_current_sequence_num ||
+       ((int) hdr->th_win << ctx->snd_wscale) != ctx->tcp_opposite_window_size ||
+       ctx->in_recovery || ctx->dupacks > 0 || ctx->lost_bytes > 0 || ctx->sacked_bytes > 0 ||
+       ctx->ooo_count > 0 || ctx->fin_pending || ctx->fin_received){
+        return false;
+    }
+
+    //the one option we expect is an aligned timestamp, and PAWS is for later
+    if(ctx->ts_ok){
+        if(amt_head != (int) sizeof(STCPHeader) + 12 ||
+           memcmp(packet + sizeof(STCPHeader), ts_head, sizeof(ts_head)) != 0){
+            return false;
+        }
+        memcpy(stamps, packet + sizeof(STCPHeader) + sizeof(ts_head), sizeof(stamps));
+        stamps[0] = ntohl(stamps[0]);
+        stamps[1] = ntohl(stamps[1]);
+        if((int32_t)(stamps[0] - ctx->ts_recent) < 0){
+            return false;   //PAWS, or a lapsed ts_recent; either way not for here
+        }
+    } else if(amt_head != (int) sizeof(STCPHeader)){
+        return false;
+    }
+
+    if(amt_data == 0){
+        //a bare ack for new data
+        if(!SEQ_GT(hdr->th_ack, ctx->unacked_sequence_num) ||
+           SEQ_GT(hdr->th_ack, ctx->current_sequence_num)){
+            return false;
+        }
+        if(ctx->ts_ok && SEQ_LEQ(hdr->th_seq, ctx->last_ack_sent)){
+            ts_set_recent(ctx, stamps[0]);
+        }
+        //same window, but now from this segment
+        ctx->snd_wl1 = hdr->th_seq;
+        ctx->snd_wl2 = hdr->th_ack;
+        release_acked(ctx, hdr->th_ack, ctx->ts_ok ? stamps[1] : 0);
+        return true;
+    }
+
+    //the next in-order data, acking nothing new, with room for all of it
+    if(hdr->th_ack != ctx->unacked_sequence_num || amt_data > (int) advertised_window(ctx)){
+        return false;
+    }
+    if(ctx->ts_ok && SEQ_LEQ(hdr->th_seq, ctx->last_ack_sent)){
+        ts_set_recent(ctx, stamps[0]);
+    }
+    ctx->snd_wl1 = hdr->th_seq;
+    ctx->snd_wl2 = hdr->th_ack;
+    stcp_app_send_buf(sd, ctx->rx_buf, packet + amt_head, amt_data);
+    ringConsume(&ctx->opposite_buffer, amt_data);
+    ctx->opposite_current_sequence_num += amt_data;
+    ctx->delack_bytes += amt_data;
+    tune_rcvbuf(ctx, amt_data);
+    schedule_ack(sd, ctx, false);
+    return true;
+}
+
+static void process_segment(mysocket_t sd, context_t *ctx, char *recv_buffer, int num_read){
+    if(num_read < (int)sizeof(STCPHeader) || (int)TCP_DATA_START(recv_buffer) > num_read){
+        //runt, drop it
+        return;
+    }
+
+    if(predicted_segment(sd, ctx, recv_buffer, num_read)){
+        return;
+    }
+
+    //the header is read where it landed, the struct is packed
+    STCPHeader* recv_header = (STCPHeader *) recv_buffer;
+    tcp_options_t opts;
+    
+    int amt_head = (size_t)TCP_DATA_START(recv_buffer);
+    int amt_data = num_read - amt_head;
+
+    parse_options(recv_buffer, num_read, &opts);
+
+    LOG_TRACE("sd %d: recv flags 0x%02x seq %u ack %u win %u len %d", sd, recv_header->th_flags,
+              recv_header->th_seq, recv_header->th_ack, recv_header->th_win, amt_data);
+
+    if(ctx->ts_ok && opts.ts_present){
+        if(paws_reject(ctx, opts.tsval)){
+            //an old duplicate, maybe from the last time round the sequence
+            //space
+            if(amt_data > 0){
+                schedule_ack(sd, ctx, true);
+            }
+            return;
+        }
+        //only an in-order segment moves the clock we echo (RFC 7323 4.3)
+        if(SEQ_LEQ(recv_header->th_seq, ctx->last_ack_sent)){
+            ts_set_recent(ctx, opts.tsval);
+        }
+    }
+
+    //analyze struct
+    if(recv_header->th_flags&TH_ACK) { 
+        process_ack(sd, ctx, recv_header, &opts, amt_data);
+    }
+
+    bool need_ack = false;
+    bool ack_now = false;
+
+    if(amt_data > 0) { //otherwise access the data part of the packet
+        
+        //the ack we send back tells the peer where we're at, so a hole shows
+        //up there as a duplicate ack
+        //out-of-order data, or data that fills a hole, is acked at once so
+        //the sender hears about it (RFC 5681 4.2)
+        bool had_hole = ctx->ooo_count > 0;
+        if(recv_data(sd, ctx, recv_header->th_seq, &recv_buffer[amt_head], amt_data)){
+            if(had_hole){
+                ack_now = true;
+            } else {
+                ctx->delack_bytes += amt_data;
+            }
+            need_ack = true;
+        } else if(ctx->sack_permitted){
+            //one ack with SACK blocks at the end of the batch says it all
+            ack_now = true;
+            need_ack = true;
+        } else {
+            //without SACK the sender counts duplicates, so each one goes
+            send_just_header(sd,ctx,TH_ACK);
+        }
+    }
+
+    //nothing new and behind what we expect: a keepalive probe, which the
+    //ack back answers
+    if(amt_data == 0 && !(recv_header->th_flags & (TH_SYN|TH_FIN)) &&
+       SEQ_LT(recv_header->th_seq, ctx->opposite_current_sequence_num)){
+        need_ack = true;
+        ack_now = true;
+    }
+
+    if(recv_header->th_flags&TH_FIN) { 
+        LOG_DEBUG("sd %d: FIN at seq %u", sd, recv_header->th_seq + amt_data);
+
+        //only take the FIN once everything before it has arrived
+        if(!ctx->fin_received){
+            ctx->fin_pending = TRUE;
+            ctx->fin_seq = recv_header->th_seq + amt_data;
+        }
+        need_ack = true;
+        ack_now = true;
+    }
+
+    if(ctx->fin_pending && ctx->fin_seq == ctx->opposite_current_sequence_num){
+        ctx->opposite_current_sequence_num++;
+        ctx->fin_received = TRUE;
+        ctx->fin_pending = FALSE;
+    }
+
+    if(need_ack){
+        schedule_ack(sd, ctx, ack_now);
+    }
+}
+
+static void recv_sumthin_from_network(mysocket_t sd, context_t *ctx){
+    char *recv_buffer;
+
+    //the segment is read where the network thread put it, and in-order
+    //data goes up to the app from there without being copied
+    int num_read = (int) stcp_network_recv_buf(sd, &ctx->rx_buf, &recv_buffer);
+
+    if(num_read <= 0){
+        //the network layer under us is gone, nothing more will arrive
+        ctx->done = TRUE;
+    } else {
+        process_segment(sd, ctx, recv_buffer, num_read);
+    }
+    stcp_buf_release(ctx->rx_buf);
+    ctx->rx_buf = NULL;
+}
+
+static bool recv_sumthin_from_app(mysocket_t sd, context_t *ctx){
+    
+    //never take more than the peer can hold or we can keep around for resending
+    int room = MIN(usable_window(ctx), (int) ringSpace(&ctx->current_buffer));
+    if(room <= 0){
+        return false;
+    }
+
+    //receive the data from the app straight into the send buffer, where it
+    //stays until it is acked.  stcp_app_recv() blocks on an empty queue, so
+    //it only gets one call: if the space wraps the data comes in through
+    //the packet scratch and is copied over
+    struct iovec space[2];
+    size_t want = MIN(ctx->mss, room);
+    size_t num_read;
+
+    ringWritable(&ctx->current_buffer, space);
+    if(space[0].iov_len >= want){
+        num_read = stcp_app_recv(sd, space[0].iov_base, want);
+        ringCommit(&ctx->current_buffer, (uint32_t) num_read);
+    } else {
+        num_read = stcp_app_recv(sd, ctx->packet, want);
+        ringWrite(&ctx->current_buffer, ctx->packet, (uint32_t) num_read);
+    }
+
+    LOG_TRACE("sd %d: %zu bytes from app at seq %u", sd, num_read, ctx->current_sequence_num);
+
+    //advances our seq number
+    send_new_segment(sd, ctx, (int) num_read, 0);
+
+    return num_read > 0;
+}
+
+/* Nagle: while data is unacked, or while the app has the socket corked,
+ * small writes wait in the app queue until there's a full segment of them.
+ * the mysock layer still hands them over once the app flushes or closes.
+ */
+static void update_app_low_water(mysocket_t sd, context_t *ctx){
+    bool hold = stcp_get_option(sd, MYSO_CORK) > 0 ||
+        (!ctx->nodelay && ctx->current_sequence_num != ctx->unacked_sequence_num);
+    size_t low_water = hold ? MIN((size_t) ctx->mss, ringCapacity(&ctx->current_buffer)) : 0;
+
+    if(low_water != ctx->app_low_water){
+        stcp_app_set_low_water(sd, low_water);
+        ctx->app_low_water = low_water;
+    }
+}
+
+/* checks for more of an event without waiting, by handing
+ * stcp_wait_for_event() an abstime that has long passed.  a close request
+ * can turn up whatever we ask for, so it's added to *seen rather than lost.
+ */
+static unsigned int poll_event(mysocket_t sd, unsigned int flags, unsigned int *seen){
+    static const struct timespec poll_only = { 0, 0 };
+    unsigned int event = stcp_wait_for_event(sd, flags, &poll_only);
+
+    *seen |= event & APP_CLOSE_REQUESTED;
+    return event;
+}
+
+/* waits for something to do and does the work every connected state shares:
+ * taking app data while the window allows, handling segments from the peer
+ * and retransmitting on timeout.  returns the events that were seen.
+ */
+static unsigned int service_events(mysocket_t sd, context_t *ctx, bool can_take_app_data){
+    unsigned int flags = NETWORK_DATA | APP_CLOSE_REQUESTED | APP_DRAINED;
+    unsigned int event;
+
+    tune_sndbuf(ctx);
+    check_persist(ctx);
+    //room to send and nothing from the app to fill it: whatever rate the
+    //next acks show is the app's, not the path's
+    if(usable_window(ctx) > 0 && ctx->lost_bytes == 0 && stcp_app_pending(sd) == 0){
+        ctx->cc.send_limited = true;
+    }
+    if(can_take_app_data && can_send_data(ctx)){
+        flags |= APP_DATA;
+        update_app_low_water(sd, ctx);
+    } else if(can_take_app_data && ctx->tcp_opposite_window_size == 0 &&
+              ctx->rtx_count == 0 && !tw_pending(&ctx->persist_timer)){
+        //a shut window and nothing to send yet: the app's next write,
+        //however small, is what starts the persist timer
+        flags |= APP_DATA;
+        if(ctx->app_low_water != 0){
+            stcp_app_set_low_water(sd, 0);
+            ctx->app_low_water = 0;
+        }
+    }
+
+    event = stcp_wait_for_event(sd, flags, next_deadline(ctx));
+
+    if(event & NETWORK_DATA){
+        //everything already queued is handled before we answer, so one ack
+        //covers the lot.  an abstime in the past just polls
+        int handled = 0;
+        do {
+            recv_sumthin_from_network(sd, ctx);
+        } while(!ctx->done && ++handled < NET_BATCH_MAX &&
+                (poll_event(sd, NETWORK_DATA, &event) & NETWORK_DATA));
+        if(ctx->keepalive_us > 0){
+            peer_heard(ctx);
+        }
+    }
+    if((event & APP_DATA) && !ctx->done){
+        //fill as much of the window as the app has data for; the first
+        //segment can take the ack along with it
+        while(recv_sumthin_from_app(sd, ctx) && can_send_data(ctx)){
+            update_app_low_water(sd, ctx);
+            if(!(poll_event(sd, APP_DATA, &event) & APP_DATA)){
+                break;
+            }
+        }
+    }
+    if(event & APP_CLOSE_REQUESTED){
+        ctx->app_closed = TRUE;
+    }
+    if(event & APP_DRAINED){
+        ctx->drain_mark_set = FALSE;
+    }
+    if(!ctx->done){
+        flush_ack(sd, ctx);
+        run_timers(ctx);
+        send_pending(sd, ctx);
+        check_window_update(sd, ctx);
+    }
+    return event;
+}
+
+
+/* control_loop() is the main STCP loop; it repeatedly waits for one of the
+ * following to happen:
+ *   - incoming data from the peer
+ *   - new data from the application (via mywrite())
+ *   - the socket to be closed (via myclose())
+ *   - a timeout
+ */
+static void control_loop(mysocket_t sd, context_t *ctx)
+{
+    assert(ctx);
+    assert(!ctx->done);
+
+    LOG_DEBUG("sd %d: established, seq %u peer seq %u mss %d", sd,
+              ctx->current_sequence_num, ctx->opposite_current_sequence_num, ctx->mss);
+
+    //nothing is in flight once the handshake is over
+    ctx->unacked_sequence_num = ctx->current_sequence_num;
+
+    // ESTABLISHED state
+    while (!ctx->done && (ctx->state == PASSIVE_ESTABLISHED || ctx->state == ACTIVE_ESTABLISHED))
+    {
+        service_events(sd, ctx, true);
+
+        const transition_t *t = next_transition(ctx);
+        if(t){
+            take_transition(sd, ctx, t);
+        }
+    }
+    while (!ctx->done) {
+        const transition_t *t = next_transition(ctx);
+
+        if(t){
+            //execute the event and advance the state
+            take_transition(sd, ctx, t);
+            continue;
+        }
+
+        //we can still send while the peer is the only one done
+        service_events(sd, ctx, ctx->state == CLOSE_WAIT);
+    }
+}
+
+static void maid_active(mysocket_t sd, context_t *ctx) {
+    // sends a fin packet. we're not waiting for it to close because that's fin_wait_1's problem
+    send_new_segment(sd, ctx, 0, TH_FIN);
+}
+static void maid_passive(mysocket_t sd, context_t *ctx) {
+    // send EOF
+    send_new_segment(sd, ctx, 0, TH_FIN);
+}
+
+static void close_wait(mysocket_t sd, context_t *ctx) {
+    // peer is done writing; the fin was acked when it came in
+    stcp_fin_received(sd);
+}
+
+static void close_fork(mysocket_t sd, context_t *ctx) {
+    // fin has been received before ack of fin, enter CLOSING
+    if (ctx->fin_received) { 
+        stcp_fin_received(sd);
+    } 
+    // otherwise our fin was acked, enter FIN_WAIT_2
+}
+static void wait_fin(mysocket_t sd, context_t *ctx) {
+    stcp_fin_received(sd);
     ctx->done = true;
 }
 
 static void wait_ackfin(mysocket_t sd, context_t *ctx) {
-    recv_sumthin_from_network(sd, ctx);
     ctx->done = true;
 }
 
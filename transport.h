@@ -73,7 +73,31 @@ typedef struct tcphdr
 /* length of options (in bytes) in TCP packet p */
 #define TCP_OPTIONS_LEN(p) (TCP_DATA_START(p) - sizeof(struct tcphdr))
 
-/* STCP maximum segment size */
+/* most option bytes a header can carry (th_off tops out at 15 words) */
+#define TCP_MAX_OPTIONS_LEN 40
+
+/* TCP options STCP understands.  unlike the fixed header fields, option
+ * contents are in network byte order.
+ */
+#define TCPOPT_EOL              0
+#define TCPOPT_NOP              1
+#define TCPOPT_MAXSEG           2   /* RFC 9293, SYN only */
+#define TCPOPT_WINDOW           3   /* RFC 7323 window scale, SYN only */
+#define TCPOPT_SACK_PERMITTED   4   /* RFC 2018, SYN only */
+#define TCPOPT_SACK             5   /* RFC 2018 */
+#define TCPOPT_TIMESTAMP        8   /* RFC 7323 */
+
+#define TCPOLEN_MAXSEG          4
+#define TCPOLEN_WINDOW          3
+#define TCPOLEN_SACK_PERMITTED  2
+#define TCPOLEN_SACK_BLOCK      8   /* per block, after kind and length */
+#define TCPOLEN_TIMESTAMP       10
+
+#define TCP_MAX_WINSHIFT        14  /* largest window scale allowed */
+
+/* STCP maximum segment size, assumed of a peer whose SYN doesn't say.
+ * the MSS option raises it to what both ends' networks can carry.
+ */
 #define STCP_MSS 536
 
 
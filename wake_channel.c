@@ -0,0 +1,167 @@
+/*
+ * wake_channel.c
+ *
+ * per-thread wakeups for the mysock layer's queues and events.
+ *
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <assert.h>
+#include "mysock_impl.h"    /* PTHREAD_CALL */
+#include "wake_channel.h"
+
+#ifdef LINUX
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* the kernel sees seq as a plain 32-bit word */
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "futex word must be 32 bits");
+#endif
+
+
+void _wake_channel_init(wake_channel_t *ch)
+{
+    assert(ch);
+
+    ch->seq.store(0, std::memory_order_relaxed);
+    ch->events.store(0, std::memory_order_relaxed);
+
+#ifndef LINUX
+    {
+        pthread_condattr_t cond_attr;
+
+        PTHREAD_CALL(pthread_condattr_init(&cond_attr));
+        PTHREAD_CALL(pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC));
+        PTHREAD_CALL(pthread_cond_init(&ch->cond, &cond_attr));
+        PTHREAD_CALL(pthread_condattr_destroy(&cond_attr));
+        PTHREAD_CALL(pthread_mutex_init(&ch->lock, NULL));
+    }
+#endif
+}
+
+void _wake_channel_destroy(wake_channel_t *ch)
+{
+    assert(ch);
+
+#ifndef LINUX
+    PTHREAD_CALL(pthread_cond_destroy(&ch->cond));
+    PTHREAD_CALL(pthread_mutex_destroy(&ch->lock));
+#else
+    (void) ch;
+#endif
+}
+
+uint32_t _wake_channel_prepare(wake_channel_t *ch, unsigned int events)
+{
+    uint32_t seq;
+
+    assert(ch && events);
+
+    /* the count is read before the events are published, so a waker that
+     * sees them bumps it past what we read, and the futex won't sleep
+     */
+    seq = ch->seq.load(std::memory_order_acquire);
+    ch->events.store(events, std::memory_order_release);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return seq;
+}
+
+bool_t _wake_channel_sleep(wake_channel_t        *ch,
+                           uint32_t               seq,
+                           const struct timespec *abstime)
+{
+    assert(ch);
+
+#ifdef LINUX
+    /* none of the ways out is an error, so errno is left as it was:  STCP
+     * passes errno up to the app when a connection comes up
+     * (stcp_unblock_application()), and a stray EAGAIN from here would fail
+     * myconnect()
+     */
+    int saved_errno = errno;
+    bool_t woken = TRUE;
+
+    /* FUTEX_WAIT_BITSET takes an absolute timeout, on CLOCK_MONOTONIC
+     * unless told otherwise
+     */
+    if (syscall(SYS_futex, (uint32_t *) &ch->seq,
+                FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, seq, abstime,
+                NULL, FUTEX_BITSET_MATCH_ANY) == 0)
+        return TRUE;
+
+    switch (errno)
+    {
+    case EAGAIN:    /* woken before we got there */
+    case EINTR:
+        break;
+
+    case ETIMEDOUT:
+        woken = FALSE;
+        break;
+
+    default:
+        assert(0);
+        break;
+    }
+    errno = saved_errno;
+    return woken;
+#else
+    bool_t woken = TRUE;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ch->lock));
+    while (ch->seq.load(std::memory_order_relaxed) == seq)
+    {
+        if (!abstime)
+        {
+            PTHREAD_CALL(pthread_cond_wait(&ch->cond, &ch->lock));
+            continue;
+        }
+
+        switch (pthread_cond_timedwait(&ch->cond, &ch->lock, abstime))
+        {
+        case 0:
+        case EINTR:
+            break;
+
+        case ETIMEDOUT:
+            woken = FALSE;
+            goto done;
+
+        default:
+            assert(0);
+            goto done;
+        }
+    }
+
+done:
+    PTHREAD_CALL(pthread_mutex_unlock(&ch->lock));
+    return woken;
+#endif
+}
+
+void _wake_channel_wake(wake_channel_t *ch, unsigned int events)
+{
+    assert(ch);
+
+    /* the fence orders whatever we've just published before our look at
+     * the sleeper's events, as _wake_channel_prepare() orders its events
+     * before its look at our news, so one of us always sees the other
+     */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!(ch->events.load(std::memory_order_acquire) & events))
+        return;
+
+#ifdef LINUX
+    ch->seq.fetch_add(1, std::memory_order_release);
+    (void) syscall(SYS_futex, (uint32_t *) &ch->seq,
+                   FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX, NULL, NULL, 0);
+#else
+    PTHREAD_CALL(pthread_mutex_lock(&ch->lock));
+    ch->seq.fetch_add(1, std::memory_order_release);
+    PTHREAD_CALL(pthread_mutex_unlock(&ch->lock));
+    PTHREAD_CALL(pthread_cond_broadcast(&ch->cond));
+#endif
+}
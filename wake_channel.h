@@ -0,0 +1,75 @@
+/* wake_channel.h--a place for one thread to sleep until another has
+ * something for it.
+ *
+ * each thread that blocks in the mysock layer has a channel of its own, so
+ * whoever has news for it wakes just that thread, and only if it's asleep
+ * waiting for that sort of news.  a sleeper says which events it's after
+ * (a bit vector of its own choosing) before its last look at whatever it's
+ * waiting on; a waker publishes its news first, then looks at the sleeper's
+ * events, and makes a system call only if they include its own.  between
+ * the two, either the sleeper sees the news or the waker sees the sleeper.
+ *
+ * on Linux this is a futex on a wakeup count; elsewhere it falls back to a
+ * mutex and condition variable per channel.  timeouts are absolute times on
+ * CLOCK_MONOTONIC either way.
+ */
+
+#ifndef __WAKE_CHANNEL_H__
+#define __WAKE_CHANNEL_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include "mysock.h"         /* bool_t */
+#include "packet_pool.h"    /* CACHE_LINE_LEN */
+
+#define WAKE_ANY    (~0u)   /* every event a sleeper might be after */
+
+typedef struct
+{
+    /* bumped by each wakeup, so a sleeper can tell whether it has missed
+     * one since it last looked; the futex word on Linux
+     */
+    alignas(CACHE_LINE_LEN) std::atomic<uint32_t> seq;
+
+    /* the events the sleeper is waiting for, 0 when it's awake */
+    std::atomic<unsigned int> events;
+
+#ifndef LINUX
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+#endif
+} wake_channel_t;
+
+void _wake_channel_init(wake_channel_t *ch);
+
+void _wake_channel_destroy(wake_channel_t *ch);
+
+/* about to sleep on ch for any of events.  returns the wakeup count to pass
+ * to _wake_channel_sleep(); the caller must look at what it's waiting on
+ * again afterwards, and only sleep if there's still nothing there.
+ */
+uint32_t _wake_channel_prepare(wake_channel_t *ch, unsigned int events);
+
+/* sleep until woken after _wake_channel_prepare() returned seq, or until
+ * abstime (never, if NULL).  returns FALSE on timeout, TRUE otherwise,
+ * spuriously included; the caller looks again either way, and calls
+ * _wake_channel_prepare() before sleeping again.
+ */
+bool_t _wake_channel_sleep(wake_channel_t        *ch,
+                           uint32_t               seq,
+                           const struct timespec *abstime);
+
+/* done sleeping on ch */
+static inline void _wake_channel_finish(wake_channel_t *ch)
+{
+    ch->events.store(0, std::memory_order_relaxed);
+}
+
+/* wake ch's sleeper if it's waiting for any of events, once whatever it's
+ * waiting on has been published
+ */
+void _wake_channel_wake(wake_channel_t *ch, unsigned int events);
+
+#endif  /* __WAKE_CHANNEL_H__ */
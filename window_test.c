@@ -0,0 +1,252 @@
+/*
+ * window_test.c
+ *
+ * pushes a stream through a receiver that keeps its window small, from a
+ * sender that corks its writes.  the process forks into the two, as
+ * alloc_test does.  the receiver
+ *
+ *   - has the smallest receive buffer there is (MYBUF_MIN), so the
+ *     window keeps filling up and opening again, one update at a time;
+ *   - stops reading for a spell partway through, so that the window
+ *     shuts and the sender has to probe it;
+ *   - checks every byte it reads against what the sender wrote.
+ *
+ * the sender writes in odd sizes with MYSO_CORK set, myflush()es every so
+ * often, and clears MYSO_CORK for the tail.  run it under STCP_DROP and
+ * STCP_REORDER (see network.c) to take the probes and window updates
+ * through loss and reordering as well.
+ *
+ * usage: window_test [-c reno|cubic|bbr] [-k kilobytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mysock.h"
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+#define DEFAULT_KB          512
+#define STALL_MS            1500    /* long enough for a few probes */
+#define READ_LEN            700
+#define FLUSH_EVERY         16      /* writes between myflush() calls */
+
+/* the byte at offset i of the stream */
+#define PATTERN(i)          ((unsigned char) ((i) * 7 + ((i) >> 11)))
+
+static char usage[] = "usage: window_test [-c reno|cubic|bbr] [-k kilobytes]\n";
+
+static int run_receiver(int port_fd, int congestion, long total);
+static int run_sender(unsigned short port, int congestion, long total);
+
+
+/**********************************************************************/
+int
+main(int argc, char *argv[])
+{
+    long total_kb = DEFAULT_KB;
+    int congestion = MYCC_RENO;
+    unsigned short port;
+    int opt, status, rc;
+    int port_fds[2];
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "c:k:")) != EOF)
+    {
+        switch (opt)
+        {
+        case 'c':
+            if ((congestion = mycongestion_by_name(optarg)) < 0)
+            {
+                fputs(usage, stderr);
+                return 1;
+            }
+            break;
+        case 'k':
+            total_kb = atol(optarg);
+            break;
+        default:
+            fputs(usage, stderr);
+            return 1;
+        }
+    }
+
+    if (optind != argc || total_kb <= 0)
+    {
+        fputs(usage, stderr);
+        return 1;
+    }
+
+    /* the receiver listens on whatever port it's given, and says which */
+    if (pipe(port_fds) < 0)
+    {
+        perror("pipe");
+        return 1;
+    }
+
+    fflush(stdout);
+    if ((pid = fork()) < 0)
+    {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0)
+    {
+        close(port_fds[0]);
+        rc = run_receiver(port_fds[1], congestion, total_kb * 1024);
+        fflush(stdout);
+        _exit(rc);
+    }
+
+    close(port_fds[1]);
+    if (read(port_fds[0], &port, sizeof(port)) != sizeof(port))
+        rc = 1;     /* the receiver has said why */
+    else
+        rc = run_sender(port, congestion, total_kb * 1024);
+    close(port_fds[0]);
+
+    if (waitpid(pid, &status, 0) < 0)
+    {
+        perror("waitpid");
+        return 1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        rc = 1;
+
+    printf("window_test: %s\n", rc ? "FAILED" : "passed");
+    return rc;
+}
+
+
+static int run_receiver(int port_fd, int congestion, long total)
+{
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+    mysocket_t bindsd, sd;
+    long got = 0, stall_at = total / 3;
+    char buf[READ_LEN];
+    ssize_t n, i;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port        = 0;
+
+    if ((bindsd = mysocket()) < 0 ||
+        mysetsockopt(bindsd, MYSO_CONGESTION, congestion) < 0 ||
+        mysetsockopt(bindsd, MYSO_RCVBUF, MYBUF_MIN) < 0 ||
+        mybind(bindsd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+        mylisten(bindsd, 1) < 0 ||
+        mygetsockname(bindsd, (struct sockaddr *) &sin, &sin_len) < 0)
+    {
+        perror("receiver");
+        return 1;
+    }
+    if (write(port_fd, &sin.sin_port, sizeof(sin.sin_port)) !=
+        sizeof(sin.sin_port))
+    {
+        perror("write");
+        return 1;
+    }
+    close(port_fd);
+    if ((sd = myaccept(bindsd, NULL, NULL)) < 0)
+    {
+        perror("myaccept");
+        return 1;
+    }
+
+    while ((n = myread(sd, buf, sizeof(buf))) > 0)
+    {
+        for (i = 0; i < n; ++i)
+        {
+            if ((unsigned char) buf[i] != PATTERN(got + i))
+            {
+                fprintf(stderr, "receiver: byte %ld is wrong\n", got + i);
+                return 1;
+            }
+        }
+        if (got < stall_at && got + n >= stall_at)
+            usleep(STALL_MS * 1000);
+        got += n;
+    }
+    if (n < 0)
+    {
+        perror("myread");
+        return 1;
+    }
+    if (got != total)
+    {
+        fprintf(stderr, "receiver: got %ld bytes, expected %ld\n", got, total);
+        return 1;
+    }
+
+    myclose(sd);
+    myclose(bindsd);
+    return 0;
+}
+
+static int run_sender(unsigned short port, int congestion, long total)
+{
+    struct sockaddr_in sin;
+    mysocket_t sd;
+    unsigned char *data;
+    long sent = 0, tail = total - total / 16;
+    int writes = 0;
+    long i;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port        = port;
+
+    if (!(data = (unsigned char *) malloc(total)))
+    {
+        perror("malloc");
+        return 1;
+    }
+    for (i = 0; i < total; ++i)
+        data[i] = PATTERN(i);
+
+    if ((sd = mysocket()) < 0 ||
+        mysetsockopt(sd, MYSO_CONGESTION, congestion) < 0 ||
+        mysetsockopt(sd, MYSO_CORK, 1) < 0 ||
+        myconnect(sd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+    {
+        perror("sender");
+        free(data);
+        return 1;
+    }
+
+    /* writes of 1 to 3001 bytes, none of them lining up with a segment */
+    while (sent < total)
+    {
+        size_t len = (size_t) MIN(1 + (sent * 13) % 3001, total - sent);
+        ssize_t n;
+
+        if (sent < tail && sent + (long) len >= tail)
+            mysetsockopt(sd, MYSO_CORK, 0);
+        if ((n = mywrite(sd, data + sent, len)) < 0)
+        {
+            perror("mywrite");
+            myclose(sd);
+            free(data);
+            return 1;
+        }
+        sent += n;
+        if (++writes % FLUSH_EVERY == 0)
+            myflush(sd);
+    }
+
+    myclose(sd);
+    free(data);
+    return 0;
+}